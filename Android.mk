@@ -3,15 +3,28 @@ LOCAL_PATH := $(call my-dir)
 include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES := \
+    src/AllocCounter.cpp \
     src/AndroidDesktop.cpp \
     src/AndroidPixelBuffer.cpp \
     src/AndroidSocket.cpp \
+    src/FrameCopier.cpp \
     src/InputDevice.cpp \
+    src/MemoryPressure.cpp \
+    src/SendBatcher.cpp \
+    src/SharedFramebuffer.cpp \
+    src/StartupTimer.cpp \
+    src/ThreadPolicy.cpp \
+    src/VNCStats.cpp \
     src/VirtualDisplay.cpp \
+    src/WorkerDesktop.cpp \
+    src/WorkerPool.cpp \
     src/main.cpp
 
-#LOCAL_SRC_FILES += \
-#    aidl/org/chemlab/IVNCService.aidl
+LOCAL_SRC_FILES += \
+    aidl/org/chemlab/IVNCService.aidl
+
+LOCAL_AIDL_INCLUDES := \
+    $(LOCAL_PATH)/aidl
 
 LOCAL_C_INCLUDES += \
     $(LOCAL_PATH)/src \
@@ -35,6 +48,7 @@ LOCAL_CFLAGS := -DVNCFLINGER_VERSION="1.0"
 LOCAL_CFLAGS += -Ofast -Werror -std=c++11 -fexceptions
 
 #LOCAL_CFLAGS += -DLOG_NDEBUG=0
+#LOCAL_CFLAGS += -DVNCFLINGER_COUNT_ALLOCATIONS
 #LOCAL_CXX := /usr/bin/include-what-you-use
 
 LOCAL_INIT_RC := etc/vncflinger.rc
@@ -49,3 +63,5 @@ ifneq ($(VNCFLINGER_DESKTOP_NAME),)
 endif
 
 include $(BUILD_EXECUTABLE)
+
+include $(call all-makefiles-under,$(LOCAL_PATH))
@@ -0,0 +1,101 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+
+#include <stdlib.h>
+
+#include <atomic>
+#include <new>
+
+#include "AllocCounter.h"
+
+using namespace vncflinger;
+
+#ifdef VNCFLINGER_COUNT_ALLOCATIONS
+
+static std::atomic<uint64_t> sAllocations(0);
+static thread_local bool sTracked = false;
+
+void* operator new(size_t size) {
+    if (sTracked) {
+        sAllocations.fetch_add(1, std::memory_order_relaxed);
+    }
+    void* p = malloc(size > 0 ? size : 1);
+    if (p == NULL) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    if (sTracked) {
+        sAllocations.fetch_add(1, std::memory_order_relaxed);
+    }
+    return malloc(size > 0 ? size : 1);
+}
+
+void* operator new[](size_t size, const std::nothrow_t& tag) noexcept {
+    return operator new(size, tag);
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete[](void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept {
+    free(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept {
+    free(p);
+}
+
+bool AllocCounter::enabled() {
+    return true;
+}
+
+void AllocCounter::track() {
+    sTracked = true;
+}
+
+uint64_t AllocCounter::count() {
+    return sAllocations.load(std::memory_order_relaxed);
+}
+
+#else
+
+bool AllocCounter::enabled() {
+    return false;
+}
+
+void AllocCounter::track() {
+}
+
+uint64_t AllocCounter::count() {
+    return 0;
+}
+
+#endif
@@ -0,0 +1,45 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+
+#ifndef ALLOC_COUNTER_H_
+#define ALLOC_COUNTER_H_
+
+#include <stdint.h>
+
+namespace vncflinger {
+
+// Counts calls to operator new made by the threads of the frame path, so
+// that its steady state can be checked for them. malloc is not hooked,
+// so C code such as rfb::Region, which allocates on every union and
+// intersection, is not seen. Binder threads and anything else which did
+// not ask to be tracked are left out. Only active when built with
+// VNCFLINGER_COUNT_ALLOCATIONS.
+class AllocCounter {
+  public:
+    static bool enabled();
+
+    // count allocations made by the calling thread from now on
+    static void track();
+
+    // allocations so far by tracked threads, always 0 when not enabled
+    static uint64_t count();
+};
+};
+
+#endif
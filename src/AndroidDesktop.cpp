@@ -1,30 +1,172 @@
 #define LOG_TAG "AndroidDesktop"
+#define ATRACE_TAG ATRACE_TAG_GRAPHICS
 #include <utils/Log.h>
+#include <utils/Trace.h>
 
+#include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 #include <sys/eventfd.h>
 
+#include <algorithm>
+#include <vector>
+
 #include <gui/ISurfaceComposer.h>
 #include <gui/SurfaceComposerClient.h>
 
 #include <ui/DisplayInfo.h>
 
+#include <org/chemlab/IVNCService.h>
+
+#include <rfb/Configuration.h>
 #include <rfb/PixelFormat.h>
 #include <rfb/Rect.h>
 #include <rfb/ScreenSet.h>
+#include <rfb/util.h>
 
+#include "AllocCounter.h"
 #include "AndroidDesktop.h"
 #include "AndroidPixelBuffer.h"
+#include "FrameCopier.h"
 #include "InputDevice.h"
+#include "SharedFramebuffer.h"
+#include "StartupTimer.h"
+#include "ThreadPolicy.h"
 #include "VirtualDisplay.h"
 
 using namespace vncflinger;
 using namespace android;
+using org::chemlab::IVNCService;
+
+// parameters which setParameter may change. they are read on the server
+// thread each time they are used. security, listener and device settings
+// need a restart.
+static const char* const kTunableParameters[] = {
+    "MaxFrameAge",  "PowerSaveRate",     "FocusSize",   "RefineDelay", "TypeClientCutText",
+    "StallTimeout", "InputPollInterval", "DeferUpdate", "CompareFB",   "FrameRate",
+};
+
+static rfb::IntParameter captureRate("CaptureRate",
+                                      "Maximum number of frames per second to capture (0 = no limit)",
+                                      0);
+
+static rfb::IntParameter copyThreads("CopyThreads",
+                                      "Number of threads used to copy frames (0 = automatic)", 0);
+static rfb::IntParameter maxFrameAge("MaxFrameAge",
+                                     "Milliseconds after composition at which a frame is skipped "
+                                     "if a newer one is due (0 = never)",
+                                     50);
+static rfb::IntParameter stallTimeout("StallTimeout",
+                                      "Milliseconds without a frame after which a stalled capture "
+                                      "pipeline is rebuilt (0 = never)",
+                                      5000);
+static rfb::BoolParameter lowColor("LowColor",
+                                   "Capture in 16-bit RGB565 to halve memory bandwidth", false);
+static rfb::IntParameter powerSaveRate("PowerSaveRate",
+                                        "Frames per second to capture while the display is off "
+                                        "or dozing (0 = pause)",
+                                        1);
+static rfb::StringParameter backlightPath("BacklightPath",
+                                          "Brightness file polled to follow the display power state "
+                                          "(empty = only the control service sets it)",
+                                          "/sys/class/leds/lcd-backlight/brightness");
+static rfb::IntParameter backlightPollInterval("BacklightPollInterval",
+                                               "Milliseconds between reads of the backlight", 1000);
+
+static rfb::BoolParameter typeClientCutText("TypeClientCutText",
+                                            "Type text from the client clipboard into the "
+                                            "focused app",
+                                            false);
+
+static rfb::IntParameter focusSize("FocusSize",
+                                    "Size of the area around the pointer which is sent ahead of "
+                                    "the rest of a large update (0 = off)",
+                                    256);
+static rfb::IntParameter refineDelay("RefineDelay",
+                                     "Milliseconds before the rest of a large update is sent "
+                                     "if the client has not caught up",
+                                     100);
+
+static rfb::StringParameter regionOfInterest("RegionOfInterest",
+                                             "Only capture this part of the display, as WxH+X+Y",
+                                             "");
+
+// parse a WxH+X+Y geometry, an empty string selects the whole display
+static bool parseGeometry(const char* str, Rect* out) {
+    int w, h, x, y;
+    if (str[0] == '\0') {
+        *out = Rect();
+        return true;
+    }
+    if (sscanf(str, "%dx%d+%d+%d", &w, &h, &x, &y) != 4 || w <= 0 || h <= 0 || x < 0 || y < 0) {
+        return false;
+    }
+    *out = Rect(x, y, x + w, y + h);
+    return true;
+}
+
+AndroidDesktop::AndroidDesktop(int32_t displayId, uint32_t layerStack)
+    : mDisplayId(displayId),
+      mLayerStack(layerStack),
+      mSessionStart(0),
+      mWaitingForFirstFrame(false),
+      mFrameAllocStart(0),
+      mNextDisplayQuery(0),
+      mClientDemand(true),
+      mHaveHeldBuffer(false),
+      mLastQueuedFrame(0),
+      mLastLockedFrame(0),
+      mBadFrameFormat(-1),
+      mFrameTimer(this),
+      mNextFrameTime(0),
+      mLastFrameTimestamp(0),
+      mFrameInterval(0),
+      mHeldFrameDeferred(false),
+      mFrameRateLimit((int)captureRate),
+      mPowerState(IVNCService::DISPLAY_STATE_ON),
+      mPendingPowerState(-1),
+      mBacklightTimer(this),
+      mBacklightFd(-1),
+      mBacklightOn(true),
+      mCaptureSizePending(false),
+      mRegionPending(false),
+      mPendingWorkerThreads((int)copyThreads),
+      mForceFullFrame(true),
+      mLowColor((bool)lowColor),
+      mLowColorPending(false),
+      mMemoryPressure(MemoryPressure::LEVEL_NONE),
+      mAppliedPressure(MemoryPressure::LEVEL_NONE),
+      mServer(NULL),
+      mServerActive(false),
+      mCursorPos(-1, -1),
+      mWatchdogTimer(this),
+      mFramesQueued(0),
+      mFramesLocked(0),
+      mLockFailures(0),
+      mLastLockTime(0),
+      mLastTouchTime(0),
+      mLastFrameTime(0),
+      mRecoveryStart(0),
+      mInputRetries(0),
+      mNextInputRetry(0),
+      mRefineTimer(this) {
+    // input is always routed to the default display
+    if (mDisplayId == ISurfaceComposer::eDisplayIdMain) {
+        mInputDevice = new InputDevice();
+    }
+    mGeometry = std::make_shared<Geometry>();
+
+    // only the initial value, later sessions keep what was set at runtime
+    rfb::CharArray roi(regionOfInterest.getData());
+    if (!parseGeometry(roi.buf, &mRegionOfInterest)) {
+        ALOGW("Ignoring invalid region of interest: %s", roi.buf);
+    }
 
-AndroidDesktop::AndroidDesktop() {
-    mInputDevice = new InputDevice();
-    mDisplayRect = Rect(0, 0);
+    snprintf(mTraceTrack, sizeof(mTraceTrack), "VNC frame display %d", mDisplayId);
+    mStats.displayPowerState = mPowerState;
 
     mEventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
     if (mEventFd < 0) {
@@ -34,50 +176,366 @@ AndroidDesktop::AndroidDesktop() {
 }
 
 AndroidDesktop::~AndroidDesktop() {
-    mInputDevice->stop();
+    if (mInputDevice != NULL) {
+        mInputDevice->stop();
+    }
+    if (mBacklightFd >= 0) {
+        close(mBacklightFd);
+    }
     close(mEventFd);
 }
 
+// query the display and create the input device before any client
+// connects, so that starting a session only has to set up the
+// virtual display. the input device is created in the background.
+status_t AndroidDesktop::prepare() {
+    mMainDpy = SurfaceComposerClient::getBuiltInDisplay(mDisplayId);
+    if (mMainDpy == NULL) {
+        ALOGE("Display %d is not connected", mDisplayId);
+        return NAME_NOT_FOUND;
+    }
+
+    status_t err = SurfaceComposerClient::getDisplayInfo(mMainDpy, &mDisplayInfo);
+    if (err != NO_ERROR) {
+        ALOGE("Failed to get display characteristics\n");
+        return err;
+    }
+    StartupTimer::mark("display query");
+
+    if (mInputDevice == NULL) {
+        return NO_ERROR;
+    }
+
+    bool rotated = mDisplayInfo.orientation != DISPLAY_ORIENTATION_0 &&
+                   mDisplayInfo.orientation != DISPLAY_ORIENTATION_180;
+    mInputDevice->start_async(rotated ? mDisplayInfo.h : mDisplayInfo.w,
+                              rotated ? mDisplayInfo.w : mDisplayInfo.h);
+
+    return NO_ERROR;
+}
+
 void AndroidDesktop::start(rfb::VNCServer* vs) {
-    mMainDpy = SurfaceComposerClient::getBuiltInDisplay(ISurfaceComposer::eDisplayIdMain);
+    Mutex::Autolock _l(mLock);
 
     mServer = vs;
+    mServerActive = true;
+
+    mCursorPos = rfb::Point(-1, -1);
+
+    if (mPixels != NULL) {
+        // already capturing for local clients
+        mServer->setPixelBuffer(mPixels.get(), computeScreenLayout());
+        return;
+    }
+
+    startCapture();
+}
+
+void AndroidDesktop::stop() {
+    Mutex::Autolock _L(mLock);
+
+    mServerActive = false;
+
+    if (mSharedFb != NULL && mSharedFb->hasClients()) {
+        // keep capturing for local clients
+        return;
+    }
+
+    stopCapture();
+}
+
+void AndroidDesktop::startCapture() {
+    mSessionStart = systemTime(SYSTEM_TIME_MONOTONIC);
+    mWaitingForFirstFrame = true;
+
+    if (mMainDpy == NULL) {
+        mMainDpy = SurfaceComposerClient::getBuiltInDisplay(mDisplayId);
+    }
 
     mPixels = new AndroidPixelBuffer();
+    {
+        Mutex::Autolock _l(mStatsLock);
+        mPixels->setLowColor(mLowColor || mAppliedPressure >= MemoryPressure::LEVEL_REDUCE);
+        mLowColorPending = false;
+    }
+    if (mAppliedPressure >= MemoryPressure::LEVEL_REDUCE) {
+        mPixels->setSizeDivisor(kReducedSizeDivisor);
+    }
     mPixels->setDimensionsChangedListener(this);
 
+    mPixels->setSourceCrop(mRegionOfInterest);
+
     if (updateDisplayInfo() != NO_ERROR) {
         ALOGE("Failed to query display!");
         return;
     }
 
+    // the backlight belongs to the default display
+    rfb::CharArray backlight(backlightPath.getData());
+    if (mDisplayId == ISurfaceComposer::eDisplayIdMain && backlight.buf[0] != '\0') {
+        if (mBacklightFd < 0) {
+            mBacklightFd = open(backlight.buf, O_RDONLY | O_CLOEXEC);
+        }
+        if (mBacklightFd < 0) {
+            ALOGW("Not following display power, failed to open %s: %s", backlight.buf,
+                  strerror(errno));
+        } else {
+            mBacklightTimer.start(backlightPollInterval);
+        }
+    }
+
+    if (stallTimeout > 0) {
+        mLockFailures = 0;
+        mFramesLocked = mFramesQueued;
+        mLastLockTime = systemTime(SYSTEM_TIME_MONOTONIC);
+        mWatchdogTimer.start(kWatchdogIntervalMs);
+    }
+
+    StartupTimer::mark("desktop started");
     ALOGV("Desktop is running");
 }
 
-void AndroidDesktop::stop() {
-    Mutex::Autolock _L(mLock);
-
+void AndroidDesktop::stopCapture() {
     ALOGV("Shutting down");
 
     mServer->setPixelBuffer(0);
 
+    mFrameTimer.stop();
+    mBacklightTimer.stop();
+    mWatchdogTimer.stop();
+    mRefineTimer.stop();
+    mDeferredDamage.clear();
+    releaseHeldFrame();
+    endQueuedFrameTraces();
     mVirtualDisplay.clear();
     mPixels.clear();
+
+    publishGeometry();
+}
+
+void AndroidDesktop::setSharedFramebuffer(rfb::VNCServer* vs, const sp<SharedFramebuffer>& fb) {
+    Mutex::Autolock _l(mLock);
+
+    mServer = vs;
+    mSharedFb = fb;
+    mSharedFb->setClientsChangedListener(this);
+    mSharedFb->setInputListener(this);
+}
+
+// local clients need frames even when no RFB client is connected
+void AndroidDesktop::onLocalClientsChanged(size_t count) {
+    Mutex::Autolock _l(mLock);
+
+    if (count > 0 && mPixels == NULL) {
+        startCapture();
+    } else if (count == 0 && !mServerActive && mPixels != NULL) {
+        stopCapture();
+    }
+}
+
+// drain the queue down to the newest frame, which stays locked until it
+// has been copied. older frames are released without being touched.
+bool AndroidDesktop::acquireLatestFrame() {
+    ATRACE_CALL();
+
+    for (;;) {
+        CpuConsumer::LockedBuffer imgBuffer;
+        status_t res = mVirtualDisplay->getConsumer()->lockNextBuffer(&imgBuffer);
+        if (res == BAD_VALUE) {
+            // queue is empty
+            break;
+        } else if (res != OK) {
+            ALOGE("Failed to lock next buffer: %s (%d)", strerror(-res), res);
+            mLockFailures++;
+            break;
+        }
+        mLockFailures = 0;
+        mFramesLocked++;
+        mLastLockedFrame = imgBuffer.frameNumber;
+        mLastLockTime = systemTime(SYSTEM_TIME_MONOTONIC);
+        // the pipeline answered the touch, whether or not the frame is
+        // copied. throttling and missing demand skip the copy.
+        mLastTouchTime = 0;
+
+        if (mHaveHeldBuffer) {
+            releaseHeldFrame();
+            Mutex::Autolock _l(mStatsLock);
+            mStats.framesDropped++;
+            ATRACE_INT64("VNC frames dropped", mStats.framesDropped);
+        }
+        mHeldBuffer = imgBuffer;
+        mHaveHeldBuffer = true;
+        mHeldFrameDeferred = false;
+
+        // cadence of the display while it is animating
+        if (mLastFrameTimestamp > 0 && imgBuffer.timestamp > mLastFrameTimestamp) {
+            mFrameInterval = imgBuffer.timestamp - mLastFrameTimestamp;
+        }
+        mLastFrameTimestamp = imgBuffer.timestamp;
+    }
+    return mHaveHeldBuffer;
+}
+
+// ends the frame's trace slice, whether it was copied or not
+void AndroidDesktop::releaseHeldFrame() {
+    if (mHaveHeldBuffer) {
+        ATRACE_ASYNC_END(mTraceTrack, (int32_t)mHeldBuffer.frameNumber);
+        mVirtualDisplay->getConsumer()->unlockBuffer(mHeldBuffer);
+        mHaveHeldBuffer = false;
+    }
+}
+
+// frames still queued in a consumer which goes away are never locked,
+// their slices end here. numbers start over with the next consumer.
+void AndroidDesktop::endQueuedFrameTraces() {
+    uint64_t last = mLastQueuedFrame.exchange(0);
+    if (ATRACE_ENABLED()) {
+        for (uint64_t n = mLastLockedFrame + 1; n <= last; n++) {
+            ATRACE_ASYNC_END(mTraceTrack, (int32_t)n);
+        }
+    }
+    mLastLockedFrame = 0;
 }
 
 void AndroidDesktop::processFrames() {
+    if (beginFrame()) {
+        copyFrame();
+        endFrame();
+    }
+}
+
+// picks up the newest frame if one is due, on the server thread
+bool AndroidDesktop::beginFrame() {
+    ATRACE_CALL();
     Mutex::Autolock _l(mLock);
 
-    updateDisplayInfo();
+    applyParameters();
 
-    // get a frame from the virtual display
-    CpuConsumer::LockedBuffer imgBuffer;
-    status_t res = mVirtualDisplay->getConsumer()->lockNextBuffer(&imgBuffer);
-    if (res != OK) {
-        ALOGE("Failed to lock next buffer: %s (%d)", strerror(-res), res);
-        return;
+    if (mPixels == NULL) {
+        return false;
+    }
+
+    applyCaptureSize();
+    applyRegionOfInterest();
+    applyMemoryPressure();
+    applyWorkerThreads();
+    applyLowColor();
+    applyDisplayPowerState();
+
+    // picks up rotation
+    nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+    if (now >= mNextDisplayQuery) {
+        mNextDisplayQuery = now + ms2ns(kDisplayQueryIntervalMs);
+        updateDisplayInfo();
+    }
+
+    // get the newest frame from the virtual display
+    if (mVirtualDisplay == NULL || !acquireLatestFrame() || !checkFrameFormat()) {
+        return false;
+    }
+
+    // nobody could take an update, the newest frame waits for demand
+    if (!mClientDemand && !mForceFullFrame) {
+        return false;
+    }
+
+    // nobody is looking while the display is off, keep the queue moving
+    // without copying or drop to a keepalive rate
+    int fps = mFrameRateLimit;
+    if (mPowerState != IVNCService::DISPLAY_STATE_ON) {
+        int keepalive = powerSaveRate;
+        if (keepalive <= 0) {
+            releaseHeldFrame();
+            Mutex::Autolock _l(mStatsLock);
+            mStats.framesDropped++;
+            return false;
+        }
+        fps = fps > 0 ? std::min(fps, keepalive) : keepalive;
+    }
+
+    // a frame which is already old is not worth sending when a newer one
+    // is due. wait one frame interval for it, and only send the old one
+    // if the display has gone idle in the meantime.
+    nsecs_t maxAge = ms2ns(maxFrameAge);
+    if (maxAge > 0 && !mHeldFrameDeferred && now - mHeldBuffer.timestamp > maxAge &&
+        mFrameInterval > 0 && mFrameInterval < maxAge) {
+        mHeldFrameDeferred = true;
+        if (!mFrameTimer.isStarted()) {
+            mFrameTimer.start(ns2ms(mFrameInterval) + 1);
+        }
+        Mutex::Autolock _l(mStatsLock);
+        mStats.framesStale++;
+        return false;
+    }
+
+    // hold on to the frame if it arrived ahead of the rate limit
+    if (fps > 0 && now < mNextFrameTime) {
+        if (!mFrameTimer.isStarted()) {
+            mFrameTimer.start(ns2ms(mNextFrameTime - now) + 1);
+        }
+        return false;
+    }
+
+    // slots follow the previous one so timer slack does not add up, but
+    // after falling behind the cadence restarts instead of catching up
+    if (fps > 0) {
+        nsecs_t period = s2ns(1) / fps;
+        nsecs_t next = mNextFrameTime + period;
+        mNextFrameTime = next > now ? next : now + period;
+    } else {
+        mNextFrameTime = 0;
+    }
+
+    mFrameAllocStart = AllocCounter::count();
+    return true;
+}
+
+// SurfaceFlinger does not always honour the requested format. rows of a
+// frame in another format would be copied with the wrong length, so it
+// is dropped and the pixel buffer switched to what was delivered.
+bool AndroidDesktop::checkFrameFormat() {
+    int format = mHeldBuffer.format;
+    bool lowColor = format == PIXEL_FORMAT_RGB_565;
+    bool known = lowColor || format == PIXEL_FORMAT_RGBX_8888 || format == PIXEL_FORMAT_RGBA_8888;
+    if (known && mPixels->getPF().bpp == (lowColor ? 16 : 32)) {
+        return true;
+    }
+
+    if (format != mBadFrameFormat) {
+        ALOGW("Frame format %d does not match the %d bpp pixel buffer", format,
+              mPixels->getPF().bpp);
+        mBadFrameFormat = format;
+    }
+    releaseHeldFrame();
+    {
+        Mutex::Autolock _l(mStatsLock);
+        mStats.framesDropped++;
     }
 
+    // recreates the virtual display in the delivered format
+    if (known) {
+        mPixels->setLowColor(lowColor);
+    }
+    return false;
+}
+
+// copies the frame picked by beginFrame, may run on any thread. no lock
+// is taken since the server thread waits for the copy to complete before
+// it touches the pixel buffer or the held frame again.
+void AndroidDesktop::copyFrame() {
+    nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+
+    CpuConsumer::LockedBuffer& imgBuffer = mHeldBuffer;
+
+    // the frame number matches the one SurfaceFlinger and BufferQueue
+    // use in their own slices for this consumer
+    char traceName[48] = "copyFrame";
+    if (ATRACE_ENABLED()) {
+        snprintf(traceName, sizeof(traceName), "copyFrame %" PRIu64, imgBuffer.frameNumber);
+    }
+    ATRACE_NAME(traceName);
+    ATRACE_INT64("VNC frame number", imgBuffer.frameNumber);
+
     mFrameNumber = imgBuffer.frameNumber;
     ALOGV("processFrame: [%" PRIu64 "] format: %x (%dx%d, stride=%d)", mFrameNumber, imgBuffer.format,
           imgBuffer.width, imgBuffer.height, imgBuffer.stride);
@@ -85,16 +543,573 @@ void AndroidDesktop::processFrames() {
     // we don't know if there was a stride change until we get
     // a buffer from the queue. if it changed, we need to resize
 
-    rfb::Rect bufRect(0, 0, imgBuffer.width, imgBuffer.height);
+    mFrameRect = rfb::Rect(0, 0, std::min((int)imgBuffer.width, mPixels->width()),
+                           std::min((int)imgBuffer.height, mPixels->height()));
 
     // performance is extremely bad if the gpu memory is used
     // directly without copying because it is likely uncached
-    mPixels->imageRect(bufRect, imgBuffer.data, imgBuffer.stride);
+    int bytesPerPixel = mPixels->getPF().bpp / 8;
+    int dstStride;
+    rdr::U8* dst = mPixels->getBufferRW(mFrameRect, &dstStride);
+
+    size_t damagedPixels =
+        mCopier->copy(imgBuffer.data, imgBuffer.stride * bytesPerPixel, dst,
+                      dstStride * bytesPerPixel, mFrameRect.width(), mFrameRect.height(),
+                      bytesPerPixel, mForceFullFrame, &mFrameDamage);
+    mForceFullFrame = false;
+
+    mPixels->commitBufferRW(mFrameRect);
+
+    releaseHeldFrame();
 
-    mVirtualDisplay->getConsumer()->unlockBuffer(imgBuffer);
+    // composition to copy, which is most of what pacing can influence
+    nsecs_t latency = start - imgBuffer.timestamp;
+    ATRACE_INT64("VNC frame latency us", ns2us(latency));
+
+    nsecs_t copyTime = systemTime(SYSTEM_TIME_MONOTONIC) - start;
+    mLastFrameTime = start + copyTime;
+    {
+        Mutex::Autolock _l(mStatsLock);
+        if (mRecoveryStart > 0) {
+            mStats.recoveryTimeLastMs = ns2ms(mLastFrameTime - mRecoveryStart);
+            mRecoveryStart = 0;
+        }
+        mStats.frameLatencyLastUs = ns2us(latency);
+        mStats.frameLatencyMaxUs = std::max(mStats.frameLatencyMaxUs, (int64_t)ns2us(latency));
+        mStats.framesCaptured++;
+        mStats.copyTimeLastUs = ns2us(copyTime);
+        mStats.copyTimeMaxUs = std::max(mStats.copyTimeMaxUs, (int64_t)ns2us(copyTime));
+        mStats.copyTimeTotalUs += ns2us(copyTime);
+        mStats.damagedPixels += damagedPixels;
+    }
+}
+
+// hands the copied frame to the clients, on the server thread. true if
+// they were given any damage.
+bool AndroidDesktop::endFrame() {
+    ATRACE_CALL();
+    Mutex::Autolock _l(mLock);
+
+    if (mFrameDamage.is_empty()) {
+        Mutex::Autolock _l(mStatsLock);
+        mStats.framesUnchanged++;
+        return false;
+    }
+
+    if (mSharedFb != NULL) {
+        mSharedFb->publish(mPixels, mFrameDamage);
+    }
 
     // update clients
-    mServer->add_changed(bufRect);
+    if (mServerActive) {
+        addChanged(mFrameDamage);
+    }
+
+    if (AllocCounter::enabled()) {
+        int64_t allocs = AllocCounter::count() - mFrameAllocStart;
+        ATRACE_INT64("VNC frame new calls", allocs);
+
+        Mutex::Autolock _l(mStatsLock);
+        mStats.frameNewCalls = allocs;
+    }
+
+    if (mWaitingForFirstFrame) {
+        mWaitingForFirstFrame = false;
+        StartupTimer::mark("first frame");
+
+        Mutex::Autolock _l(mStatsLock);
+        mStats.timeToFirstFrameMs = ns2ms(systemTime(SYSTEM_TIME_MONOTONIC) - mSessionStart);
+        ALOGI("Session time to first frame: %" PRId64 "ms", mStats.timeToFirstFrameMs);
+    }
+    return mServerActive;
+}
+
+// rate limited frame is now due
+bool AndroidDesktop::handleTimeout(rfb::Timer* t) {
+    if (t == &mBacklightTimer) {
+        pollBacklight();
+        return true;
+    }
+    if (t == &mWatchdogTimer) {
+        checkPipeline();
+        return true;
+    }
+    if (t == &mRefineTimer) {
+        flushDeferredDamage();
+        return false;
+    }
+    processFrames();
+    return false;
+}
+
+// follow the panel when nothing tells us about power changes
+void AndroidDesktop::pollBacklight() {
+    char buf[16];
+    ssize_t len = pread(mBacklightFd, buf, sizeof(buf) - 1, 0);
+    if (len <= 0) {
+        return;
+    }
+    buf[len] = '\0';
+
+    bool on = atoi(buf) > 0;
+    if (on != mBacklightOn) {
+        mBacklightOn = on;
+        setDisplayPowerState(on ? IVNCService::DISPLAY_STATE_ON : IVNCService::DISPLAY_STATE_OFF);
+    }
+}
+
+// called from a binder thread, applied by the server loop
+void AndroidDesktop::setDisplayPowerState(int state) {
+    {
+        Mutex::Autolock _l(mStatsLock);
+        mPendingPowerState = state;
+    }
+    notify();
+}
+
+void AndroidDesktop::applyDisplayPowerState() {
+    int state;
+    {
+        Mutex::Autolock _l(mStatsLock);
+        state = mPendingPowerState;
+        mPendingPowerState = -1;
+    }
+    if (state < 0 || state == mPowerState) {
+        return;
+    }
+
+    ALOGD("Display power state %d -> %d", mPowerState, state);
+    if (state == IVNCService::DISPLAY_STATE_ON) {
+        // resume right away and resend everything
+        mFrameTimer.stop();
+        mNextFrameTime = 0;
+        mForceFullFrame = true;
+    }
+    mPowerState = state;
+
+    Mutex::Autolock _l(mStatsLock);
+    mStats.displayPowerState = state;
+}
+
+void AndroidDesktop::setFrameRateLimit(int fps) {
+    ALOGD("Capture frame rate limit: %d", fps);
+    mFrameRateLimit = std::max(fps, 0);
+}
+
+// called from a binder thread, applied by the server loop
+void AndroidDesktop::setCaptureSize(uint32_t width, uint32_t height) {
+    {
+        Mutex::Autolock _l(mStatsLock);
+        mPendingCaptureWidth = width;
+        mPendingCaptureHeight = height;
+        mCaptureSizePending = true;
+    }
+    notify();
+}
+
+void AndroidDesktop::applyCaptureSize() {
+    uint32_t width, height;
+    {
+        Mutex::Autolock _l(mStatsLock);
+        if (!mCaptureSizePending) {
+            return;
+        }
+        mCaptureSizePending = false;
+        width = mPendingCaptureWidth;
+        height = mPendingCaptureHeight;
+    }
+
+    // zero restores the native resolution of the display
+    if (width == 0 || height == 0) {
+        Rect source = mPixels->getSourceRect();
+        width = source.getWidth();
+        height = source.getHeight();
+    }
+
+    ALOGD("Capture size requested: %ux%u", width, height);
+    mPixels->setWindowSize(width, height);
+    mServer->setScreenLayout(computeScreenLayout());
+}
+
+// called from a binder thread, applied by the server loop
+void AndroidDesktop::setWorkerThreads(int threads) {
+    {
+        Mutex::Autolock _l(mStatsLock);
+        mPendingWorkerThreads = threads;
+    }
+    notify();
+}
+
+static void initCopyThread() {
+    ThreadPolicy::apply(ThreadPolicy::ROLE_CAPTURE);
+    AllocCounter::track();
+}
+
+void AndroidDesktop::applyWorkerThreads() {
+    int threads;
+    {
+        Mutex::Autolock _l(mStatsLock);
+        threads = mPendingWorkerThreads;
+        mPendingWorkerThreads = -1;
+    }
+    if (threads < 0) {
+        return;
+    }
+
+    // zero picks a default for this device
+    if (threads == 0) {
+        threads = std::min(4L, std::max(1L, sysconf(_SC_NPROCESSORS_ONLN)));
+    }
+
+    // the stats keep the requested count, restored once pressure clears
+    int effective = mAppliedPressure >= MemoryPressure::LEVEL_TRIM ? 1 : threads;
+    if (mCopier == NULL || (int)mCopier->threads() != effective) {
+        ALOGD("Copying frames with %d threads", effective);
+        mCopier.reset(new FrameCopier(effective, initCopyThread));
+    }
+
+    Mutex::Autolock _l(mStatsLock);
+    mStats.workerThreads = threads;
+}
+
+// called from a binder thread, applied by the server loop
+void AndroidDesktop::setLowColor(bool enable) {
+    {
+        Mutex::Autolock _l(mStatsLock);
+        mLowColor = enable;
+        mLowColorPending = true;
+    }
+    notify();
+}
+
+void AndroidDesktop::applyLowColor() {
+    bool enable;
+    {
+        Mutex::Autolock _l(mStatsLock);
+        if (!mLowColorPending) {
+            return;
+        }
+        mLowColorPending = false;
+        enable = mLowColor;
+    }
+
+    // clients are told about the new format along with the new buffer
+    mPixels->setLowColor(enable || mAppliedPressure >= MemoryPressure::LEVEL_REDUCE);
+}
+
+// called from a binder thread, applied by the server loop
+bool AndroidDesktop::setParameter(const char* name, const char* value) {
+    bool tunable = false;
+    for (size_t i = 0; i < sizeof(kTunableParameters) / sizeof(kTunableParameters[0]); i++) {
+        if (strcasecmp(name, kTunableParameters[i]) == 0) {
+            tunable = rfb::Configuration::getParam(kTunableParameters[i]) != NULL;
+            break;
+        }
+    }
+    if (!tunable) {
+        ALOGW("Parameter %s can't be changed at runtime", name);
+        return false;
+    }
+
+    {
+        Mutex::Autolock _l(mStatsLock);
+        mPendingParameters.push_back(std::make_pair(std::string(name), std::string(value)));
+    }
+    notify();
+    return true;
+}
+
+void AndroidDesktop::applyParameters() {
+    std::vector<std::pair<std::string, std::string> > params;
+    {
+        Mutex::Autolock _l(mStatsLock);
+        if (mPendingParameters.empty()) {
+            return;
+        }
+        params.swap(mPendingParameters);
+    }
+
+    for (size_t i = 0; i < params.size(); i++) {
+        const char* name = params[i].first.c_str();
+        const char* value = params[i].second.c_str();
+        if (rfb::Configuration::setParam(name, value)) {
+            ALOGD("Parameter %s set to %s", name, value);
+        } else {
+            ALOGW("Invalid value for parameter %s: %s", name, value);
+        }
+    }
+}
+
+void AndroidDesktop::setMemoryPressure(int level) {
+    if (level != mMemoryPressure) {
+        mMemoryPressure = level;
+        notify();
+    }
+}
+
+// memory is shed in steps and each step is undone when the level drops
+// below it again
+void AndroidDesktop::applyMemoryPressure() {
+    int level = mMemoryPressure;
+    if (level == mAppliedPressure) {
+        return;
+    }
+
+    bool trim = level >= MemoryPressure::LEVEL_TRIM;
+    bool wasTrimmed = mAppliedPressure >= MemoryPressure::LEVEL_TRIM;
+    bool reduce = level >= MemoryPressure::LEVEL_REDUCE;
+    bool wasReduced = mAppliedPressure >= MemoryPressure::LEVEL_REDUCE;
+    mAppliedPressure = level;
+
+    bool lowColor;
+    {
+        Mutex::Autolock _l(mStatsLock);
+        mStats.memoryPressure = level;
+        lowColor = mLowColor;
+
+        // copy threads follow the level through applyWorkerThreads
+        if (trim != wasTrimmed && mPendingWorkerThreads < 0) {
+            mPendingWorkerThreads = mStats.workerThreads;
+        }
+    }
+
+    if (trim != wasTrimmed) {
+        trimCaches(trim, reduce != wasReduced);
+    }
+
+    // a smaller 16-bit capture shrinks the virtual display, the shared
+    // framebuffer and the work of every encoder. clients see one resize.
+    if (reduce != wasReduced) {
+        ALOGI("%s capture for memory pressure", reduce ? "Reducing" : "Restoring");
+        mPixels->setLowColorAndSizeDivisor(lowColor || reduce, reduce ? kReducedSizeDivisor : 1);
+    }
+}
+
+// the largest cache is the shadow copy of the framebuffer which CompareFB
+// keeps in libtigervnc. it is only freed with the pixel buffer it was
+// made for, so the server gets the same buffer again unless a resize
+// replaces it anyway, and clients a full update.
+void AndroidDesktop::trimCaches(bool trim, bool resizing) {
+    rfb::VoidParameter* compareFB = rfb::Configuration::getParam("CompareFB");
+    if (trim) {
+        if (mSharedFb != NULL) {
+            mSharedFb->trim();
+        }
+        rfb::CharArray value(compareFB != NULL ? compareFB->getValueStr() : NULL);
+        if (value.buf == NULL || strcmp(value.buf, "0") == 0) {
+            return;
+        }
+        mSavedCompareFB = value.buf;
+        compareFB->setParam("0");
+        if (!resizing && mServer != NULL && mPixels != NULL && mPixels->width() > 0) {
+            mServer->setPixelBuffer(mPixels.get(), computeScreenLayout());
+        }
+    } else if (!mSavedCompareFB.empty()) {
+        // the shadow copy is made again on the next comparison
+        compareFB->setParam(mSavedCompareFB.c_str());
+        mSavedCompareFB.clear();
+    }
+}
+
+// called from a binder thread, applied by the server loop
+void AndroidDesktop::setRegionOfInterest(const Rect& region) {
+    {
+        Mutex::Autolock _l(mStatsLock);
+        mPendingRegion = region;
+        mRegionPending = true;
+    }
+    notify();
+}
+
+void AndroidDesktop::applyRegionOfInterest() {
+    Rect region;
+    {
+        Mutex::Autolock _l(mStatsLock);
+        if (!mRegionPending) {
+            return;
+        }
+        mRegionPending = false;
+        region = mPendingRegion;
+    }
+
+    ALOGD("Region of interest requested: [%d,%d,%d,%d]", region.left, region.top, region.right,
+          region.bottom);
+
+    // a new size rebuilds the virtual display, otherwise just move it
+    mRegionOfInterest = region;
+    mPixels->setSourceCrop(region);
+    Rect crop = mPixels->getSourceCrop();
+    if (mVirtualDisplay != NULL && !(mVirtualDisplay->getSourceRect() == crop)) {
+        mVirtualDisplay->setSourceRect(crop);
+        publishGeometry();
+    }
+}
+
+// replaces the geometry snapshot used by the input path
+void AndroidDesktop::publishGeometry() {
+    std::shared_ptr<Geometry> geom = std::make_shared<Geometry>();
+
+    if (mVirtualDisplay != NULL && mPixels != NULL) {
+        geom->viewport = mVirtualDisplay->getDisplayRect();
+        geom->source = mPixels->getSourceCrop();
+        geom->bounds = mPixels->getDisplayBounds();
+        geom->buffer = Rect(mPixels->width(), mPixels->height());
+        if (!geom->viewport.isEmpty()) {
+            geom->scaleX = (float)geom->source.getWidth() / (float)geom->viewport.getWidth();
+            geom->scaleY = (float)geom->source.getHeight() / (float)geom->viewport.getHeight();
+        }
+    }
+
+    std::atomic_store(&mGeometry, std::shared_ptr<const Geometry>(geom));
+}
+
+void AndroidDesktop::setClientCount(int clients) {
+    Mutex::Autolock _l(mStatsLock);
+    mStats.clients = clients;
+}
+
+// looks for a capture pipeline which stopped delivering frames. a static
+// screen produces none either, so only positive signs of trouble count.
+void AndroidDesktop::checkPipeline() {
+    Mutex::Autolock _l(mLock);
+
+    if (mVirtualDisplay == NULL) {
+        return;
+    }
+
+    nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+    nsecs_t timeout = ms2ns(stallTimeout);
+
+    if (mLockFailures >= kMaxLockFailures) {
+        recover("buffers can't be locked");
+    } else if (mFramesQueued - mFramesLocked > kMaxQueuedFrames && now - mLastLockTime > timeout) {
+        recover("frames are queued but not delivered");
+    } else if (mLastTouchTime > 0 && now - mLastTouchTime > timeout && mClientDemand &&
+               mPowerState == IVNCService::DISPLAY_STATE_ON) {
+        // a touch nearly always redraws something, if only a ripple
+        recover("no frames after input");
+    }
+
+    // the input device is not covered by frames, check it separately. one
+    // which keeps failing is retried less and less often.
+    if (mInputDevice == NULL) {
+        return;
+    }
+    if (!mInputDevice->isFailed()) {
+        if (mInputRetries > 0) {
+            mInputRetries = 0;
+            mNextInputRetry = 0;
+            Mutex::Autolock _l(mStatsLock);
+            mStats.inputDeviceRetries = 0;
+        }
+    } else if (now >= mNextInputRetry) {
+        int delay = kWatchdogIntervalMs << std::min(mInputRetries, (int)kMaxInputRetryShift);
+        ALOGW("Input device is not open, recreating it (attempt %d, next in %dms)",
+              mInputRetries + 1, delay);
+        Rect bounds = mPixels->getDisplayBounds();
+        mInputDevice->reconfigure(bounds.getWidth(), bounds.getHeight());
+        mInputRetries++;
+        mNextInputRetry = now + ms2ns(delay);
+
+        Mutex::Autolock _l(mStatsLock);
+        mStats.inputDeviceRetries = mInputRetries;
+    }
+}
+
+// rebuild the virtual display in place, clients stay connected and get
+// a full update from the new one
+void AndroidDesktop::recover(const char* reason) {
+    ALOGW("Capture pipeline stalled (%s), rebuilding it", reason);
+
+    nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+    mLockFailures = 0;
+    mLastTouchTime = 0;
+    mLastLockTime = now;
+    if (mRecoveryStart == 0) {
+        mRecoveryStart = now;
+    }
+
+    onBufferDimensionsChanged(mPixels->width(), mPixels->height());
+
+    // frames announced by the old display will never be locked
+    mFramesLocked = mFramesQueued;
+
+    Mutex::Autolock _l(mStatsLock);
+    mStats.stallsRecovered++;
+}
+
+// large updates go out in two steps, the tiles around the pointer
+// first, so the area being touched does not wait for the whole screen
+void AndroidDesktop::addChanged(const rfb::Region& damage) {
+    int size = focusSize;
+    if (size <= 0 || mCursorPos.x < 0 || damage.get_bounding_rect().area() <= 4 * size * size) {
+        mServer->add_changed(damage);
+        return;
+    }
+
+    // align to the tiles damage is tracked in
+    const int tile = FrameCopier::kTileSize;
+    int x0 = std::max(0, (mCursorPos.x - size / 2) / tile * tile);
+    int y0 = std::max(0, (mCursorPos.y - size / 2) / tile * tile);
+    rfb::Region focus(rfb::Rect(x0, y0, x0 + size + tile, y0 + size + tile));
+
+    rfb::Region first = damage.intersect(focus);
+    if (first.is_empty()) {
+        mServer->add_changed(damage);
+        return;
+    }
+    mServer->add_changed(first);
+
+    // older deferred damage already waited once, it goes out now
+    if (!mDeferredDamage.is_empty()) {
+        mServer->add_changed(mDeferredDamage);
+    }
+    mDeferredDamage = damage.subtract(focus);
+
+    if (!mDeferredDamage.is_empty() && !mRefineTimer.isStarted()) {
+        mRefineTimer.start(refineDelay);
+    }
+}
+
+void AndroidDesktop::flushDeferredDamage() {
+    Mutex::Autolock _l(mLock);
+
+    mRefineTimer.stop();
+    if (mServerActive && !mDeferredDamage.is_empty()) {
+        mServer->add_changed(mDeferredDamage);
+    }
+    mDeferredDamage.clear();
+}
+
+void AndroidDesktop::setClientDemand(bool demand) {
+    if (demand == mClientDemand) {
+        return;
+    }
+    mClientDemand = demand;
+
+    // the first part of a large update has gone out, send the rest
+    if (demand) {
+        flushDeferredDamage();
+    }
+
+    // pick up a frame which arrived while nobody wanted it
+    if (demand && mHaveHeldBuffer) {
+        notify();
+    }
+}
+
+void AndroidDesktop::getStats(VNCStats* stats) {
+    Mutex::Autolock _l(mStatsLock);
+    *stats = mStats;
+    stats->uptimeMs = ns2ms(StartupTimer::elapsed());
+    stats->frameRateLimit = mFrameRateLimit;
+    stats->threadPlacement = String16(ThreadPolicy::describe().c_str());
+
+    std::shared_ptr<const Geometry> geom = std::atomic_load(&mGeometry);
+    stats->captureWidth = geom->buffer.getWidth();
+    stats->captureHeight = geom->buffer.getHeight();
+    stats->viewportWidth = geom->viewport.getWidth();
+    stats->viewportHeight = geom->viewport.getHeight();
 }
 
 // notifies the server loop that we have changes
@@ -108,22 +1123,20 @@ unsigned int AndroidDesktop::setScreenLayout(int reqWidth, int reqHeight,
                                              const rfb::ScreenSet& layout) {
     Mutex::Autolock _l(mLock);
 
-    char* dbg = new char[1024];
-    layout.print(dbg, 1024);
+    char dbg[1024];
+    layout.print(dbg, sizeof(dbg));
 
     ALOGD("setScreenLayout: cur: %s  new: %dx%d", dbg, reqWidth, reqHeight);
-    delete[] dbg;
 
-    if (reqWidth == mDisplayRect.getWidth() && reqHeight == mDisplayRect.getHeight()) {
+    std::shared_ptr<const Geometry> geom = std::atomic_load(&mGeometry);
+    if (reqWidth == geom->viewport.getWidth() && reqHeight == geom->viewport.getHeight()) {
         return rfb::resultInvalid;
     }
 
     if (reqWidth > 0 && reqHeight > 0) {
         mPixels->setWindowSize(reqWidth, reqHeight);
 
-        rfb::ScreenSet screens;
-        screens.add_screen(rfb::Screen(0, 0, 0, mPixels->width(), mPixels->height(), 0));
-        mServer->setScreenLayout(screens);
+        mServer->setScreenLayout(computeScreenLayout());
         return rfb::resultSuccess;
     }
 
@@ -134,28 +1147,86 @@ unsigned int AndroidDesktop::setScreenLayout(int reqWidth, int reqHeight,
 void AndroidDesktop::onFrameAvailable(const BufferItem& item) {
     ALOGV("onFrameAvailable: [%" PRIu64 "] mTimestamp=%" PRId64, item.mFrameNumber, item.mTimestamp);
 
+    mFramesQueued++;
+    mLastQueuedFrame = item.mFrameNumber;
+
+    // spans from queueing by SurfaceFlinger until the frame is copied or dropped
+    ATRACE_ASYNC_BEGIN(mTraceTrack, (int32_t)item.mFrameNumber);
+
     notify();
 }
 
 void AndroidDesktop::keyEvent(rdr::U32 keysym, __unused_attr rdr::U32 keycode, bool down) {
+    if (mInputDevice == NULL) {
+        return;
+    }
     mInputDevice->keyEvent(down, keysym);
 }
 
 void AndroidDesktop::pointerEvent(const rfb::Point& pos, int buttonMask) {
-    if (pos.x < mDisplayRect.left || pos.x > mDisplayRect.right || pos.y < mDisplayRect.top ||
-        pos.y > mDisplayRect.bottom) {
+    if (mInputDevice == NULL) {
+        // secondary displays are view-only
+        return;
+    }
+
+    // never blocks, even while a frame is being copied or the display
+    // is being reconfigured
+    std::shared_ptr<const Geometry> geom = std::atomic_load(&mGeometry);
+    const Rect& viewport = geom->viewport;
+
+    if (viewport.isEmpty() || pos.x < viewport.left || pos.x > viewport.right ||
+        pos.y < viewport.top || pos.y > viewport.bottom) {
         // outside viewport
         return;
     }
-    uint32_t x = pos.x * ((float)(mDisplayRect.getWidth()) / (float)mPixels->width());
-    uint32_t y = pos.y * ((float)(mDisplayRect.getHeight()) / (float)mPixels->height());
+
+    // the input device spans the whole display, the viewport only the
+    // captured part of it
+    uint32_t x = geom->source.left + (pos.x - viewport.left) * geom->scaleX;
+    uint32_t y = geom->source.top + (pos.y - viewport.top) * geom->scaleY;
 
     ALOGV("pointer xlate x1=%d y1=%d x2=%d y2=%d", pos.x, pos.y, x, y);
 
-    mServer->setCursorPos(rfb::Point(x, y));
+    // other viewers follow the pointer, in framebuffer coordinates
+    if (!pos.equals(mCursorPos)) {
+        mCursorPos = pos;
+        mServer->setCursorPos(pos);
+    }
+    if (buttonMask != 0 && mLastTouchTime == 0) {
+        mLastTouchTime = systemTime(SYSTEM_TIME_MONOTONIC);
+    }
     mInputDevice->pointerEvent(buttonMask, x, y);
 }
 
+// input forwarded by worker processes
+void AndroidDesktop::onLocalPointerEvent(const rfb::Point& pos, int buttonMask) {
+    pointerEvent(pos, buttonMask);
+}
+
+void AndroidDesktop::onLocalKeyEvent(uint32_t keysym, bool down) {
+    keyEvent(keysym, 0, down);
+}
+
+// clipboard text is Latin-1
+void AndroidDesktop::clientCutText(const char* str, int len) {
+    if (!typeClientCutText || len <= 0) {
+        return;
+    }
+    std::vector<char16_t> text(len);
+    for (size_t i = 0; i < text.size(); i++) {
+        text[i] = (unsigned char)str[i];
+    }
+    typeText(String16(text.data(), text.size()));
+}
+
+int AndroidDesktop::typeText(const String16& text) {
+    size_t skipped = 0;
+    if (mInputDevice == NULL || mInputDevice->typeText(text, &skipped) != NO_ERROR) {
+        return -1;
+    }
+    return skipped;
+}
+
 // refresh the display dimensions
 status_t AndroidDesktop::updateDisplayInfo() {
     status_t err = SurfaceComposerClient::getDisplayInfo(mMainDpy, &mDisplayInfo);
@@ -173,22 +1244,36 @@ rfb::ScreenSet AndroidDesktop::computeScreenLayout() {
     rfb::ScreenSet screens;
     screens.add_screen(rfb::Screen(0, 0, 0, mPixels->width(), mPixels->height(), 0));
     return screens;
-    mServer->setScreenLayout(screens);
 }
 
 void AndroidDesktop::onBufferDimensionsChanged(uint32_t width, uint32_t height) {
-    ALOGV("Dimensions changed: old=(%ux%u) new=(%ux%u)", mDisplayRect.getWidth(),
-          mDisplayRect.getHeight(), width, height);
+    std::shared_ptr<const Geometry> geom = std::atomic_load(&mGeometry);
+    ALOGV("Dimensions changed: old=(%ux%u) new=(%ux%u)", geom->viewport.getWidth(),
+          geom->viewport.getHeight(), width, height);
 
+    releaseHeldFrame();
+    endQueuedFrameTraces();
+    mForceFullFrame = true;
     mVirtualDisplay.clear();
-    mVirtualDisplay = new VirtualDisplay(&mDisplayInfo, mPixels->width(), mPixels->height(), this);
+    mVirtualDisplay = new VirtualDisplay(
+        mPixels->getSourceCrop(), mPixels->width(), mPixels->height(), mLayerStack,
+        mPixels->isLowColor() ? PIXEL_FORMAT_RGB_565 : PIXEL_FORMAT_RGBX_8888, this);
+    {
+        // what is captured, which may differ from what was asked for
+        Mutex::Autolock _l(mStatsLock);
+        mStats.bitsPerPixel = mPixels->getPF().bpp;
+    }
 
-    mDisplayRect = mVirtualDisplay->getDisplayRect();
+    publishGeometry();
 
-    mInputDevice->reconfigure(mDisplayRect.getWidth(), mDisplayRect.getHeight());
+    if (mInputDevice != NULL) {
+        Rect bounds = mPixels->getDisplayBounds();
+        mInputDevice->reconfigure(bounds.getWidth(), bounds.getHeight());
+    }
 
-    mServer->setPixelBuffer(mPixels.get(), computeScreenLayout());
-    mServer->setScreenLayout(computeScreenLayout());
+    rfb::ScreenSet layout = computeScreenLayout();
+    mServer->setPixelBuffer(mPixels.get(), layout);
+    mServer->setScreenLayout(layout);
 }
 
 void AndroidDesktop::queryConnection(network::Socket* sock, __unused_attr const char* userName) {
@@ -1,7 +1,11 @@
 #ifndef ANDROID_DESKTOP_H_
 #define ANDROID_DESKTOP_H_
 
+#include <atomic>
 #include <memory>
+#include <string>
+#include <utility>
+#include <vector>
 
 #include <utils/Condition.h>
 #include <utils/Mutex.h>
@@ -9,29 +13,41 @@
 #include <utils/Thread.h>
 
 #include <gui/CpuConsumer.h>
+#include <gui/ISurfaceComposer.h>
 
 #include <ui/DisplayInfo.h>
 
 #include <rfb/PixelBuffer.h>
 #include <rfb/SDesktop.h>
 #include <rfb/ScreenSet.h>
+#include <rfb/Timer.h>
 
 #include "AndroidPixelBuffer.h"
+#include "FrameCopier.h"
 #include "InputDevice.h"
+#include "MemoryPressure.h"
+#include "SharedFramebuffer.h"
+#include "VNCStats.h"
 #include "VirtualDisplay.h"
 
 using namespace android;
+using org::chemlab::VNCStats;
 
 namespace vncflinger {
 
 class AndroidDesktop : public rfb::SDesktop,
                        public CpuConsumer::FrameAvailableListener,
-                       public AndroidPixelBuffer::BufferDimensionsListener {
+                       public AndroidPixelBuffer::BufferDimensionsListener,
+                       public SharedFramebuffer::ClientsChangedListener,
+                       public SharedFramebuffer::InputListener,
+                       public rfb::Timer::Callback {
   public:
-    AndroidDesktop();
+    AndroidDesktop(int32_t displayId = ISurfaceComposer::eDisplayIdMain, uint32_t layerStack = 0);
 
     virtual ~AndroidDesktop();
 
+    virtual status_t prepare();
+
     virtual void start(rfb::VNCServer* vs);
     virtual void stop();
     virtual void terminate();
@@ -40,9 +56,20 @@ class AndroidDesktop : public rfb::SDesktop,
 
     virtual void keyEvent(rdr::U32 keysym, rdr::U32 keycode, bool down);
     virtual void pointerEvent(const rfb::Point& pos, int buttonMask);
+    virtual void clientCutText(const char* str, int len);
+
+    // type text on the default display, safe to call from any thread.
+    // the number of characters skipped, -1 if none could be queued.
+    virtual int typeText(const String16& text);
 
     virtual void processFrames();
 
+    // processFrames in stages, so several displays can copy in parallel.
+    // only copyFrame may be called off the server thread.
+    virtual bool beginFrame();
+    virtual void copyFrame();
+    virtual bool endFrame();
+
     virtual int getEventFd() {
         return mEventFd;
     }
@@ -53,23 +80,230 @@ class AndroidDesktop : public rfb::SDesktop,
 
     virtual void queryConnection(network::Socket* sock, const char* userName);
 
+    virtual bool handleTimeout(rfb::Timer* t);
+
+    // serve local clients through shared memory as well
+    virtual void setSharedFramebuffer(rfb::VNCServer* vs, const sp<SharedFramebuffer>& fb);
+    virtual void onLocalClientsChanged(size_t count);
+    virtual void onLocalPointerEvent(const rfb::Point& pos, int buttonMask);
+    virtual void onLocalKeyEvent(uint32_t keysym, bool down);
+
+    // runtime tuning, safe to call from any thread
+    virtual void setFrameRateLimit(int fps);
+    virtual void setCaptureSize(uint32_t width, uint32_t height);
+    virtual void setRegionOfInterest(const Rect& region);
+    virtual void setWorkerThreads(int threads);
+    virtual void setLowColor(bool enable);
+
+    // change one of the parameters which are read while running, false
+    // for any other parameter
+    virtual bool setParameter(const char* name, const char* value);
+
+    // one of the IVNCService DISPLAY_STATE_ values
+    virtual void setDisplayPowerState(int state);
+
+    virtual void setClientCount(int clients);
+
+    // whether any client can take an update now, on the server thread.
+    // frames are only copied while there is demand.
+    virtual void setClientDemand(bool demand);
+
+    // one of the MemoryPressure levels, on the server thread
+    virtual void setMemoryPressure(int level);
+
+    // send the rest of a large update now, called once the part around
+    // the pointer has been written. RefineDelay is only the upper bound.
+    void flushDeferredDamage();
+
+    // only changed on the server thread, so it is read there unlocked
+    bool hasDeferredDamage() const {
+        return !mDeferredDamage.is_empty();
+    }
+
+    virtual void getStats(VNCStats* stats);
+
   private:
     virtual void notify();
 
+    void startCapture();
+    void stopCapture();
+
+    bool acquireLatestFrame();
+    bool checkFrameFormat();
+    void releaseHeldFrame();
+    void endQueuedFrameTraces();
+
+    void applyCaptureSize();
+    void applyRegionOfInterest();
+    void applyWorkerThreads();
+    void applyLowColor();
+    void applyDisplayPowerState();
+    void applyMemoryPressure();
+    void trimCaches(bool trim, bool resizing);
+    void applyParameters();
+
+    void pollBacklight();
+
+    void checkPipeline();
+    void recover(const char* reason);
+
+    void addChanged(const rfb::Region& damage);
+
     virtual status_t updateDisplayInfo();
 
     virtual rfb::ScreenSet computeScreenLayout();
 
-    Rect mDisplayRect;
+    // translation between the framebuffer and the display. replaced as a
+    // whole whenever it changes, so readers never need a lock.
+    struct Geometry {
+        Geometry() : scaleX(0.0f), scaleY(0.0f) {
+        }
+
+        // area of the framebuffer showing the display
+        Rect viewport;
+        // captured area of the display
+        Rect source;
+        // the whole display
+        Rect bounds;
+        // the whole framebuffer
+        Rect buffer;
+        // display pixels per framebuffer pixel
+        float scaleX, scaleY;
+    };
+
+    void publishGeometry();
+
+    std::shared_ptr<const Geometry> mGeometry;
 
     Mutex mLock;
 
+    // which display is captured
+    int32_t mDisplayId;
+    uint32_t mLayerStack;
+
+    // area of the frame being processed, and what changed in it
+    rfb::Rect mFrameRect;
+    rfb::Region mFrameDamage;
+
     uint64_t mFrameNumber;
 
+    // time the current session was started, for time-to-first-pixel
+    nsecs_t mSessionStart;
+    bool mWaitingForFirstFrame;
+
+    // heap allocations when the current frame was started
+    uint64_t mFrameAllocStart;
+
+    // the display is queried over binder, so not for every frame
+    static const int kDisplayQueryIntervalMs = 250;
+    nsecs_t mNextDisplayQuery;
+
+    // without demand the newest frame is held but not copied
+    bool mClientDemand;
+
+    // newest frame from the queue, not yet copied
+    CpuConsumer::LockedBuffer mHeldBuffer;
+    bool mHaveHeldBuffer;
+
+    // async trace slices of this display's frames, frame numbers are
+    // only unique per display
+    char mTraceTrack[32];
+    // the slices of the frames after the last locked one up to the last
+    // queued one are still open
+    std::atomic<uint64_t> mLastQueuedFrame;
+    uint64_t mLastLockedFrame;
+
+    // last frame format which could not be copied, to warn only once
+    int mBadFrameFormat;
+
+    // frame rate limiting
+    rfb::Timer mFrameTimer;
+    nsecs_t mNextFrameTime;
+
+    // composition timestamps, for skipping frames which are already old
+    nsecs_t mLastFrameTimestamp;
+    nsecs_t mFrameInterval;
+    bool mHeldFrameDeferred;
+    std::atomic<int> mFrameRateLimit;
+
+    // display power, frames are throttled while it is not on
+    int mPowerState;
+    int mPendingPowerState;
+    rfb::Timer mBacklightTimer;
+    int mBacklightFd;
+    bool mBacklightOn;
+
+    // guards the counters and pending requests from binder threads
+    Mutex mStatsLock;
+    VNCStats mStats;
+
+    bool mCaptureSizePending;
+    uint32_t mPendingCaptureWidth, mPendingCaptureHeight;
+
+    bool mRegionPending;
+    Rect mPendingRegion;
+    // on the server thread, kept across sessions
+    Rect mRegionOfInterest;
+
+    // -1 when there is no pending change
+    int mPendingWorkerThreads;
+
+    // name and value of parameters set through the control service
+    std::vector<std::pair<std::string, std::string> > mPendingParameters;
+
+    // striped copy with damage detection
+    std::unique_ptr<FrameCopier> mCopier;
+
+    // the pixel buffer contents can't be compared against
+    bool mForceFullFrame;
+
+    // 16-bit capture
+    bool mLowColor;
+    bool mLowColorPending;
+
+    // requested and applied memory pressure level
+    static const uint32_t kReducedSizeDivisor = 2;
+    int mMemoryPressure;
+    int mAppliedPressure;
+    // CompareFB from before it was turned off to free its shadow copy
+    std::string mSavedCompareFB;
+
     int mEventFd;
 
     // Server instance
     rfb::VNCServer* mServer;
+    bool mServerActive;
+
+    // last pointer position given to the server, on the server thread
+    rfb::Point mCursorPos;
+
+    // stall detection, frames announced by the consumer and locked by us
+    rfb::Timer mWatchdogTimer;
+    static const int kWatchdogIntervalMs = 1000;
+    static const int kMaxLockFailures = 5;
+    static const uint64_t kMaxQueuedFrames = 3;
+    std::atomic<uint64_t> mFramesQueued;
+    uint64_t mFramesLocked;
+    int mLockFailures;
+    nsecs_t mLastLockTime;
+    // first button press since the last copied frame
+    nsecs_t mLastTouchTime;
+    nsecs_t mLastFrameTime;
+    // when the last recovery started, 0 once a frame arrived after it
+    nsecs_t mRecoveryStart;
+
+    // failed input device reopens in a row, each one waits twice as long
+    // as the one before, up to 64 watchdog intervals
+    static const int kMaxInputRetryShift = 6;
+    int mInputRetries;
+    nsecs_t mNextInputRetry;
+
+    // damage away from the pointer, announced after the area around it
+    rfb::Region mDeferredDamage;
+    rfb::Timer mRefineTimer;
+
+    // Local shared memory clients
+    sp<SharedFramebuffer> mSharedFb;
 
     // Pixel buffer
     sp<AndroidPixelBuffer> mPixels;
@@ -77,11 +311,11 @@ class AndroidDesktop : public rfb::SDesktop,
     // Virtual display controller
     sp<VirtualDisplay> mVirtualDisplay;
 
-    // Primary display
+    // Captured display
     sp<IBinder> mMainDpy;
     DisplayInfo mDisplayInfo;
 
-    // Virtual input device
+    // Virtual input device, only on the default display
     sp<InputDevice> mInputDevice;
 };
 };
@@ -26,9 +26,22 @@ using namespace vncflinger;
 using namespace android;
 
 const rfb::PixelFormat AndroidPixelBuffer::sRGBX(32, 24, false, true, 255, 255, 255, 0, 8, 16);
+const rfb::PixelFormat AndroidPixelBuffer::sRGB565(16, 16, false, true, 31, 63, 31, 11, 5, 0);
 
 AndroidPixelBuffer::AndroidPixelBuffer()
-    : ManagedPixelBuffer(), mRotated(false), mScaleX(1.0f), mScaleY(1.0f) {
+    : ManagedPixelBuffer(),
+      mRotated(false),
+      mClientWidth(0),
+      mClientHeight(0),
+      mSourceWidth(0),
+      mSourceHeight(0),
+      mDisplayWidth(0),
+      mDisplayHeight(0),
+      mScaleX(1.0f),
+      mScaleY(1.0f),
+      mListener(nullptr),
+      mLowColor(false),
+      mSizeDivisor(1) {
     setPF(sRGBX);
     setSize(0, 0);
 }
@@ -74,6 +87,9 @@ void AndroidPixelBuffer::updateBufferSize(bool fromDisplay) {
     mScaleX = (float)mClientWidth / (float)mSourceWidth;
     mScaleY = (float)mClientHeight / (float)mSourceHeight;
 
+    w /= mSizeDivisor;
+    h /= mSizeDivisor;
+
     if (w == (uint32_t)width_ && h == (uint32_t)height_) {
         return;
     }
@@ -98,15 +114,79 @@ void AndroidPixelBuffer::setWindowSize(uint32_t width, uint32_t height) {
     }
 }
 
+void AndroidPixelBuffer::setSizeDivisor(uint32_t divisor) {
+    if (divisor == 0 || divisor == mSizeDivisor) {
+        return;
+    }
+
+    ALOGV("Buffer size divisor changed: old=%u new=%u", mSizeDivisor, divisor);
+    mSizeDivisor = divisor;
+
+    // applied once the display has been queried
+    if (mSourceWidth > 0 && mSourceHeight > 0) {
+        updateBufferSize();
+    }
+}
+
 void AndroidPixelBuffer::setDisplayInfo(DisplayInfo* info) {
     bool rotated = isDisplayRotated(info->orientation);
     setBufferRotation(rotated);
 
-    uint32_t w = rotated ? info->h : info->w;
-    uint32_t h = rotated ? info->w : info->h;
+    mDisplayWidth = rotated ? info->h : info->w;
+    mDisplayHeight = rotated ? info->w : info->h;
+
+    updateSourceSize();
+}
+
+void AndroidPixelBuffer::setLowColor(bool lowColor) {
+    if (lowColor == mLowColor) {
+        return;
+    }
+
+    ALOGV("Pixel format changed to %s", lowColor ? "RGB565" : "RGBX8888");
+    mLowColor = lowColor;
+    setPF(lowColor ? sRGB565 : sRGBX);
+
+    // the virtual display has to be recreated with the new format
+    if (mListener != nullptr) {
+        mListener->onBufferDimensionsChanged(width_, height_);
+    }
+}
+
+void AndroidPixelBuffer::setLowColorAndSizeDivisor(bool lowColor, uint32_t divisor) {
+    int oldWidth = width_, oldHeight = height_;
+    bool formatChanged = lowColor != mLowColor;
+
+    BufferDimensionsListener* listener = mListener;
+    mListener = nullptr;
+    setLowColor(lowColor);
+    setSizeDivisor(divisor);
+    mListener = listener;
+
+    if (mListener != nullptr && (formatChanged || oldWidth != width_ || oldHeight != height_)) {
+        mListener->onBufferDimensionsChanged(width_, height_);
+    }
+}
+
+void AndroidPixelBuffer::setSourceCrop(const Rect& crop) {
+    mRequestedCrop = crop;
+    updateSourceSize();
+}
+
+void AndroidPixelBuffer::updateSourceSize() {
+    // the crop is clipped to the display since rotation changes its bounds
+    Rect bounds(mDisplayWidth, mDisplayHeight);
+    Rect crop;
+    if (mRequestedCrop.isEmpty() || !mRequestedCrop.intersect(bounds, &crop)) {
+        crop = bounds;
+    }
+    mSourceCrop = crop;
+
+    uint32_t w = crop.getWidth();
+    uint32_t h = crop.getHeight();
 
     if (w != mSourceWidth || h != mSourceHeight) {
-        ALOGV("Display dimensions changed: old=(%dx%d) new=(%dx%d)", mSourceWidth, mSourceHeight, w,
+        ALOGV("Source dimensions changed: old=(%dx%d) new=(%dx%d)", mSourceWidth, mSourceHeight, w,
               h);
         mSourceWidth = w;
         mSourceHeight = h;
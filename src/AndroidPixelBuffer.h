@@ -58,9 +58,38 @@ class AndroidPixelBuffer : public RefBase, public rfb::ManagedPixelBuffer {
 
     Rect getSourceRect();
 
+    // capture in 16-bit RGB565 instead of 32-bit RGBX
+    virtual void setLowColor(bool lowColor);
+
+    bool isLowColor() {
+        return mLowColor;
+    }
+
+    // capture at a fraction of the window size, the window size itself
+    // is kept so that it comes back with a divisor of 1
+    virtual void setSizeDivisor(uint32_t divisor);
+
+    // both of the above, the listener hears about it once
+    virtual void setLowColorAndSizeDivisor(bool lowColor, uint32_t divisor);
+
+    // restrict capture to part of the display, an empty rect captures all of it
+    virtual void setSourceCrop(const Rect& crop);
+
+    // captured area in display coordinates
+    Rect getSourceCrop() {
+        return mSourceCrop;
+    }
+
+    // size of the whole display in its current orientation
+    Rect getDisplayBounds() {
+        return Rect(mDisplayWidth, mDisplayHeight);
+    }
+
   private:
     static bool isDisplayRotated(uint8_t orientation);
 
+    virtual void updateSourceSize();
+
     virtual void setBufferRotation(bool rotated);
 
     virtual void updateBufferSize(bool fromDisplay = false);
@@ -73,17 +102,30 @@ class AndroidPixelBuffer : public RefBase, public rfb::ManagedPixelBuffer {
     // preferred size of the client's window
     uint32_t mClientWidth, mClientHeight;
 
-    // size of the display
+    // size of the captured area
     uint32_t mSourceWidth, mSourceHeight;
 
+    // size of the display
+    uint32_t mDisplayWidth, mDisplayHeight;
+
+    // requested and effective region of interest
+    Rect mRequestedCrop;
+    Rect mSourceCrop;
+
     // current ratio between server and client
     float mScaleX, mScaleY;
 
     // callback when buffer size changes
     BufferDimensionsListener* mListener;
 
-    // Android virtual display is always 32-bit
+    // using sRGB565
+    bool mLowColor;
+
+    uint32_t mSizeDivisor;
+
+    // formats the virtual display can produce
     static const rfb::PixelFormat sRGBX;
+    static const rfb::PixelFormat sRGB565;
 };
 };
 
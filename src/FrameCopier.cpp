@@ -0,0 +1,163 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#define LOG_TAG "VNC-FrameCopier"
+#define ATRACE_TAG ATRACE_TAG_GRAPHICS
+#include <utils/Log.h>
+#include <utils/Trace.h>
+
+#include <string.h>
+
+#include <algorithm>
+
+#include <rfb/Rect.h>
+
+#include "FrameCopier.h"
+
+using namespace vncflinger;
+
+FrameCopier::FrameCopier(size_t threads, void (*init)())
+    : mPool(threads > 0 ? threads - 1 : 0, "copy", init) {
+}
+
+// one stripe is one row of tiles
+void FrameCopier::copyStripe(void* arg, size_t index) {
+    ATRACE_NAME("copyStripe");
+    Job* job = (Job*)arg;
+
+    int y0 = index * kTileSize;
+    int y1 = std::min(y0 + kTileSize, job->height);
+    uint8_t* tiles = job->tiles + index * job->tileCols;
+    int rowBytes = job->width * job->bytesPerPixel;
+    int tileBytes = kTileSize * job->bytesPerPixel;
+
+    if (job->force) {
+        for (int y = y0; y < y1; y++) {
+            memcpy(job->dst + y * job->dstStride, job->src + y * job->srcStride, rowBytes);
+        }
+        memset(tiles, 1, job->tileCols);
+        return;
+    }
+
+    // graphics memory is often uncached, so each row of a tile is read
+    // from it exactly once. comparing and copying use the scratch copy.
+    uint8_t scratch[kTileSize * kMaxBytesPerPixel];
+
+    memset(tiles, 0, job->tileCols);
+    for (int y = y0; y < y1; y++) {
+        const uint8_t* src = job->src + y * job->srcStride;
+        uint8_t* dst = job->dst + y * job->dstStride;
+
+        for (int c = 0, x = 0; c < job->tileCols; c++, x += tileBytes) {
+            int len = std::min(tileBytes, rowBytes - x);
+            memcpy(scratch, src + x, len);
+            if (memcmp(dst + x, scratch, len) != 0) {
+                memcpy(dst + x, scratch, len);
+                tiles[c] = 1;
+            }
+        }
+    }
+}
+
+size_t FrameCopier::copy(const uint8_t* src, int srcStride, uint8_t* dst, int dstStride,
+                         int width, int height, int bytesPerPixel, bool force,
+                         rfb::Region* changed) {
+    if (width <= 0 || height <= 0 || bytesPerPixel > kMaxBytesPerPixel) {
+        return 0;
+    }
+
+    Job job;
+    job.src = src;
+    job.srcStride = srcStride;
+    job.dst = dst;
+    job.dstStride = dstStride;
+    job.width = width;
+    job.height = height;
+    job.bytesPerPixel = bytesPerPixel;
+    job.force = force;
+    job.tileCols = (width + kTileSize - 1) / kTileSize;
+
+    size_t stripes = (height + kTileSize - 1) / kTileSize;
+    mTiles.resize(stripes * job.tileCols);
+    job.tiles = mTiles.data();
+
+    mPool.run(copyStripe, &job, stripes);
+
+    // merge runs of changed tiles within each stripe. the runs come out
+    // ordered by band and then by x, so the region is built from them in
+    // one go instead of merging a temporary region per run. like any
+    // region, a band which matches the one above is folded into it.
+    ATRACE_NAME("damage");
+    mRuns.clear();
+    mRuns.reserve(mTiles.size());
+    rfb::ShortRect extents = {(short)width, (short)height, 0, 0};
+    size_t area = 0;
+    size_t prevBand = 0, prevCount = 0;
+    for (size_t s = 0; s < stripes; s++) {
+        const uint8_t* tiles = job.tiles + s * job.tileCols;
+        int y0 = s * kTileSize;
+        int y1 = std::min(y0 + kTileSize, height);
+        size_t band = mRuns.size();
+
+        for (int c = 0; c < job.tileCols;) {
+            if (!tiles[c]) {
+                c++;
+                continue;
+            }
+            int start = c;
+            while (c < job.tileCols && tiles[c]) {
+                c++;
+            }
+            rfb::ShortRect run = {(short)(start * kTileSize), (short)y0,
+                                  (short)std::min(c * kTileSize, width), (short)y1};
+            mRuns.push_back(run);
+            extents.x1 = std::min(extents.x1, run.x1);
+            extents.x2 = std::max(extents.x2, run.x2);
+            area += (size_t)(run.x2 - run.x1) * (run.y2 - run.y1);
+        }
+
+        size_t count = mRuns.size() - band;
+        if (count == 0) {
+            continue;
+        }
+        extents.y1 = std::min(extents.y1, (short)y0);
+        extents.y2 = (short)y1;
+
+        bool same = prevCount == count && mRuns[prevBand].y2 == y0;
+        for (size_t i = 0; same && i < count; i++) {
+            same = mRuns[prevBand + i].x1 == mRuns[band + i].x1 &&
+                   mRuns[prevBand + i].x2 == mRuns[band + i].x2;
+        }
+        if (same) {
+            for (size_t i = 0; i < count; i++) {
+                mRuns[prevBand + i].y2 = (short)y1;
+            }
+            mRuns.resize(band);
+        } else {
+            prevBand = band;
+            prevCount = count;
+        }
+    }
+
+    if (mRuns.empty()) {
+        changed->clear();
+    } else {
+        changed->setExtentsAndOrderedRects(&extents, mRuns.size(), mRuns.data());
+    }
+    return area;
+}
@@ -0,0 +1,80 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#ifndef FRAME_COPIER_H_
+#define FRAME_COPIER_H_
+
+#include <stdint.h>
+
+#include <vector>
+
+#include <rfb/Region.h>
+
+#include "WorkerPool.h"
+
+namespace vncflinger {
+
+// Copies frames out of graphics memory in row stripes spread across a
+// worker pool. Each stripe compares against the previous contents while
+// copying, so the changed area is known without a second pass.
+class FrameCopier {
+  public:
+    // init is called on each copy thread, see WorkerPool
+    FrameCopier(size_t threads, void (*init)() = NULL);
+
+    size_t threads() const {
+        return mPool.concurrency();
+    }
+
+    // copy src to dst and set changed to the tiles which differed.
+    // strides are in bytes. with force, everything counts as changed.
+    // returns the area of the changed tiles.
+    size_t copy(const uint8_t* src, int srcStride, uint8_t* dst, int dstStride, int width,
+                int height, int bytesPerPixel, bool force, rfb::Region* changed);
+
+    // tiles are the granularity of damage
+    static const int kTileSize = 64;
+    static const int kMaxBytesPerPixel = 4;
+
+  private:
+    struct Job {
+        const uint8_t* src;
+        int srcStride;
+        uint8_t* dst;
+        int dstStride;
+        int width;
+        int height;
+        int bytesPerPixel;
+        bool force;
+        int tileCols;
+        uint8_t* tiles;
+    };
+
+    static void copyStripe(void* arg, size_t index);
+
+    WorkerPool mPool;
+
+    // one flag per tile, rows of tileCols
+    std::vector<uint8_t> mTiles;
+
+    // runs of changed tiles, kept to build the damage without allocating
+    std::vector<rfb::ShortRect> mRuns;
+};
+};
+
+#endif
@@ -16,14 +16,18 @@
 //
 
 #define LOG_TAG "VNC-InputDevice"
+#define ATRACE_TAG ATRACE_TAG_INPUT
 #include <utils/Log.h>
-
-#include <future>
+#include <utils/Trace.h>
 
 #include "InputDevice.h"
 
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <unistd.h>
+
+#include <algorithm>
 
 #include <sys/ioctl.h>
 
@@ -51,12 +55,29 @@ static const struct UInputOptions {
 };
 
 status_t InputDevice::start_async(uint32_t width, uint32_t height) {
-    // don't block the caller since this can take a few seconds
-    std::async(&InputDevice::start, this, width, height);
+    // don't block the caller since this can take a few seconds. the
+    // future is kept, otherwise its destructor would wait for completion.
+    waitForStart();
+    mStartResult = std::async(std::launch::async, &InputDevice::start, this, width, height);
 
     return NO_ERROR;
 }
 
+void InputDevice::waitForStart() {
+    if (mStartResult.valid()) {
+        mStartResult.wait();
+    }
+}
+
+bool InputDevice::isFailed() {
+    if (mStartResult.valid() &&
+        mStartResult.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+        return false;
+    }
+    Mutex::Autolock _l(mLock);
+    return !mOpened;
+}
+
 status_t InputDevice::start(uint32_t width, uint32_t height) {
     Mutex::Autolock _l(mLock);
 
@@ -116,6 +137,8 @@ status_t InputDevice::start(uint32_t width, uint32_t height) {
     }
 
     mOpened = true;
+    mWidth = width;
+    mHeight = height;
 
     ALOGD("Virtual input device created successfully (%dx%d)", width, height);
     return NO_ERROR;
@@ -129,6 +152,16 @@ err_ioctl:
 }
 
 status_t InputDevice::reconfigure(uint32_t width, uint32_t height) {
+    waitForStart();
+    {
+        // creating the device costs thousands of ioctls, so only
+        // recreate it when the dimensions actually changed
+        Mutex::Autolock _l(mLock);
+        if (mOpened && width == mWidth && height == mHeight) {
+            return NO_ERROR;
+        }
+    }
+
     stop();
     return start_async(width, height);
 }
@@ -201,6 +234,7 @@ void InputDevice::keyEvent(bool down, uint32_t key) {
     int sh = 0;
     int alt = 0;
 
+    ATRACE_CALL();
     Mutex::Autolock _l(mLock);
     if (!mOpened) return;
 
@@ -236,6 +270,7 @@ void InputDevice::keyEvent(bool down, uint32_t key) {
 }
 
 void InputDevice::pointerEvent(int buttonMask, int x, int y) {
+    ATRACE_CALL();
     Mutex::Autolock _l(mLock);
     if (!mOpened) return;
 
@@ -297,6 +332,176 @@ void InputDevice::pointerEvent(int buttonMask, int x, int y) {
     }
 }
 
+// typed text is written this many characters at a time, with a pause in
+// between so that InputReader and the focused app keep up
+static const size_t kTextBatchChars = 32;
+static const useconds_t kTextBatchDelayUs = 10000;
+
+// a few minutes of typing, more is refused until it has been typed
+static const size_t kMaxQueuedTextChars = 64 * 1024;
+
+status_t InputDevice::typeText(const String16& text, size_t* skipped) {
+    // uinput has no way to commit characters without a key
+    int sh, alt;
+    *skipped = 0;
+    for (size_t i = 0; i < text.size(); i++) {
+        if (charToScancode(text[i], &sh, &alt) < 0) {
+            (*skipped)++;
+        }
+    }
+    if (*skipped > 0) {
+        ALOGW("Skipping %zu characters without a key", *skipped);
+    }
+    if (text.size() == 0) {
+        return NO_ERROR;
+    }
+
+    Mutex::Autolock _l(mTextLock);
+    if (mTextQueued + text.size() > kMaxQueuedTextChars) {
+        return WOULD_BLOCK;
+    }
+    mTextQueue.push_back(text);
+    mTextQueued += text.size();
+    if (!mTextThread.joinable()) {
+        mTextThread = std::thread(&InputDevice::textLoop, this);
+        pthread_setname_np(mTextThread.native_handle(), "text-input");
+    }
+    mTextCond.signal();
+    return NO_ERROR;
+}
+
+void InputDevice::stopText() {
+    {
+        Mutex::Autolock _l(mTextLock);
+        mTextExit = true;
+        mTextQueue.clear();
+        mTextQueued = 0;
+        mTextCond.signal();
+    }
+
+    if (mTextThread.joinable()) {
+        mTextThread.join();
+    }
+}
+
+void InputDevice::textLoop() {
+    Mutex::Autolock _l(mTextLock);
+    for (;;) {
+        while (!mTextExit && mTextQueue.empty()) {
+            mTextCond.wait(mTextLock);
+        }
+        if (mTextExit) {
+            break;
+        }
+        String16 text = mTextQueue.front();
+        mTextQueue.pop_front();
+
+        mTextLock.unlock();
+        injectText(text);
+        mTextLock.lock();
+        mTextQueued -= std::min(mTextQueued, text.size());
+    }
+}
+
+void InputDevice::injectText(const String16& text) {
+    ATRACE_CALL();
+
+    const char16_t* str = text.string();
+    size_t len = text.size();
+
+    std::vector<struct input_event> events;
+    events.reserve(kTextBatchChars * 8);
+
+    size_t i = 0;
+    while (i < len) {
+        int sh, alt;
+
+        // counted and reported when the text was queued
+        while (i < len && charToScancode(str[i], &sh, &alt) < 0) {
+            i++;
+        }
+
+        // the rest goes through the device, a batch per write
+        events.clear();
+        for (size_t n = 0; i < len && n < kTextBatchChars; i++, n++) {
+            int code = charToScancode(str[i], &sh, &alt);
+            if (code < 0) {
+                break;
+            }
+            if (code > 0) {
+                appendKey(&events, code, sh, alt);
+            }
+        }
+        if (!events.empty()) {
+            if (writeEvents(events) != OK) {
+                ALOGE("Failed to type text: %s", strerror(errno));
+                return;
+            }
+            usleep(kTextBatchDelayUs);
+        }
+    }
+}
+
+// returns 0 for characters which are skipped, and -1 for those without a key
+int InputDevice::charToScancode(char16_t c, int* sh, int* alt) {
+    *sh = 0;
+    *alt = 0;
+    if (c == '\r') {
+        return 0;
+    }
+    if (c == '\n') {
+        return keysym2scancode(0xff0d, sh, alt);
+    }
+    if (c == '\t') {
+        return keysym2scancode(0xff09, sh, alt);
+    }
+    // control characters are shortcuts in keysym2scancode
+    if (c < 32 || c > 255) {
+        return -1;
+    }
+    int code = keysym2scancode(c, sh, alt);
+    return code > 0 ? code : -1;
+}
+
+static void appendEvent(std::vector<struct input_event>* events, const struct timeval& time,
+                        uint16_t type, uint16_t code, int32_t value) {
+    struct input_event event;
+    event.time = time;
+    event.type = type;
+    event.code = code;
+    event.value = value;
+    events->push_back(event);
+}
+
+// same sequence as keyEvent, without waiting for each write
+void InputDevice::appendKey(std::vector<struct input_event>* events, int code, int sh,
+                            int alt) {
+    struct timeval now;
+    gettimeofday(&now, 0);
+
+    if (sh) appendEvent(events, now, EV_KEY, 42, 1);   // left shift
+    if (alt) appendEvent(events, now, EV_KEY, 56, 1);  // left alt
+    appendEvent(events, now, EV_KEY, code, 1);
+    appendEvent(events, now, EV_SYN, SYN_REPORT, 0);
+    appendEvent(events, now, EV_KEY, code, 0);
+    if (alt) appendEvent(events, now, EV_KEY, 56, 0);
+    if (sh) appendEvent(events, now, EV_KEY, 42, 0);
+    appendEvent(events, now, EV_SYN, SYN_REPORT, 0);
+}
+
+status_t InputDevice::writeEvents(const std::vector<struct input_event>& events) {
+    Mutex::Autolock _l(mLock);
+    if (!mOpened) {
+        return NO_INIT;
+    }
+
+    size_t size = events.size() * sizeof(events[0]);
+    if (write(mFD, events.data(), size) != (ssize_t)size) {
+        return BAD_VALUE;
+    }
+    return OK;
+}
+
 // q,w,e,r,t,y,u,i,o,p,a,s,d,f,g,h,j,k,l,z,x,c,v,b,n,m
 static const int qwerty[] = {30, 48, 46, 32, 18, 33, 34, 35, 23, 36, 37, 38, 50,
                              49, 24, 25, 16, 19, 31, 20, 22, 47, 17, 45, 21, 44};
@@ -18,9 +18,16 @@
 #ifndef INPUT_DEVICE_H
 #define INPUT_DEVICE_H
 
+#include <utils/Condition.h>
 #include <utils/Errors.h>
 #include <utils/Mutex.h>
 #include <utils/RefBase.h>
+#include <utils/String16.h>
+
+#include <deque>
+#include <future>
+#include <thread>
+#include <vector>
 
 #include <linux/uinput.h>
 
@@ -36,16 +43,28 @@ class InputDevice : public RefBase {
     virtual status_t stop();
     virtual status_t reconfigure(uint32_t width, uint32_t height);
 
+    // the device is not open and no start is in progress
+    virtual bool isFailed();
+
     virtual void keyEvent(bool down, uint32_t key);
     virtual void pointerEvent(int buttonMask, int x, int y);
 
-    InputDevice() : mFD(-1) {
+    // type a string in the background, for paste and automation. only
+    // characters the keymap has a key for are typed, the number of those
+    // skipped goes to skipped. WOULD_BLOCK while too much text is queued.
+    virtual status_t typeText(const String16& text, size_t* skipped);
+
+    InputDevice()
+        : mFD(-1), mOpened(false), mWidth(0), mHeight(0), mTextQueued(0), mTextExit(false) {
     }
     virtual ~InputDevice() {
+        stopText();
+        waitForStart();
         stop();
     }
 
   private:
+    void waitForStart();
 
     status_t inject(uint16_t type, uint16_t code, int32_t value);
     status_t injectSyn(uint16_t type, uint16_t code, int32_t value);
@@ -57,6 +76,13 @@ class InputDevice : public RefBase {
 
     int keysym2scancode(uint32_t c, int* sh, int* alt);
 
+    void textLoop();
+    void stopText();
+    void injectText(const String16& text);
+    int charToScancode(char16_t c, int* sh, int* alt);
+    void appendKey(std::vector<struct input_event>* events, int code, int sh, int alt);
+    status_t writeEvents(const std::vector<struct input_event>& events);
+
     Mutex mLock;
 
     int mFD;
@@ -64,6 +90,20 @@ class InputDevice : public RefBase {
 
     struct uinput_user_dev mUserDev;
 
+    // dimensions the device was created with
+    uint32_t mWidth, mHeight;
+
+    // pending asynchronous start
+    std::future<status_t> mStartResult;
+
+    // text waiting to be typed, and the thread typing it
+    Mutex mTextLock;
+    Condition mTextCond;
+    std::deque<String16> mTextQueue;
+    size_t mTextQueued;
+    std::thread mTextThread;
+    bool mTextExit;
+
     bool mLeftClicked;
     bool mRightClicked;
     bool mMiddleClicked;
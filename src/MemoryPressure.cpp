@@ -0,0 +1,131 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#define LOG_TAG "VNC-MemoryPressure"
+#include <utils/Log.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <rfb/Configuration.h>
+#include <rfb/util.h>
+
+#include "MemoryPressure.h"
+
+using namespace vncflinger;
+
+static rfb::StringParameter someTrigger("MemoryTrimTrigger",
+                                        "PSI trigger after which caches are dropped, as "
+                                        "\"some <stall us> <window us>\"",
+                                        "some 150000 2000000");
+static rfb::StringParameter fullTrigger("MemoryReduceTrigger",
+                                        "PSI trigger after which capture is reduced, as "
+                                        "\"full <stall us> <window us>\"",
+                                        "full 100000 2000000");
+
+MemoryPressure::MemoryPressure()
+    : mSomeFd(-1), mFullFd(-1), mLevel(LEVEL_NONE), mLastStall(0), mRelaxTimer(this) {
+}
+
+MemoryPressure::~MemoryPressure() {
+    close();
+}
+
+int MemoryPressure::openTrigger(const char* trigger) {
+    // every trigger needs its own file
+    int fd = ::open("/proc/pressure/memory", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    if (write(fd, trigger, strlen(trigger) + 1) < 0) {
+        ALOGW("Failed to set memory pressure trigger \"%s\": %s", trigger, strerror(errno));
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool MemoryPressure::open() {
+    rfb::CharArray some(someTrigger.getData());
+    rfb::CharArray full(fullTrigger.getData());
+
+    mSomeFd = openTrigger(some.buf);
+    if (mSomeFd < 0) {
+        ALOGI("Memory pressure information not available: %s", strerror(errno));
+        return false;
+    }
+    mFullFd = openTrigger(full.buf);
+    return true;
+}
+
+void MemoryPressure::close() {
+    mRelaxTimer.stop();
+    if (mSomeFd >= 0) {
+        ::close(mSomeFd);
+        mSomeFd = -1;
+    }
+    if (mFullFd >= 0) {
+        ::close(mFullFd);
+        mFullFd = -1;
+    }
+    mLevel = LEVEL_NONE;
+}
+
+void MemoryPressure::addFds(fd_set* efds) {
+    if (mSomeFd >= 0) {
+        FD_SET(mSomeFd, efds);
+    }
+    if (mFullFd >= 0) {
+        FD_SET(mFullFd, efds);
+    }
+}
+
+void MemoryPressure::processEvents(fd_set* efds) {
+    if (mFullFd >= 0 && FD_ISSET(mFullFd, efds)) {
+        raise(LEVEL_REDUCE);
+    } else if (mSomeFd >= 0 && FD_ISSET(mSomeFd, efds)) {
+        raise(LEVEL_TRIM);
+    }
+}
+
+void MemoryPressure::raise(int level) {
+    mLastStall = systemTime(SYSTEM_TIME_MONOTONIC);
+    if (level > mLevel) {
+        ALOGI("Memory pressure level %d -> %d", mLevel, level);
+        mLevel = level;
+    }
+    if (!mRelaxTimer.isStarted()) {
+        mRelaxTimer.start(kRelaxIntervalMs);
+    }
+}
+
+// triggers fire at most once per window while the stall lasts, so a
+// quiet interval means it is over
+bool MemoryPressure::handleTimeout(__unused_attr rfb::Timer* t) {
+    nsecs_t quiet = systemTime(SYSTEM_TIME_MONOTONIC) - mLastStall;
+    if (quiet < ms2ns(kRelaxIntervalMs)) {
+        mRelaxTimer.start(kRelaxIntervalMs - ns2ms(quiet));
+        return false;
+    }
+
+    ALOGI("Memory pressure level %d -> %d", mLevel, mLevel - 1);
+    mLevel--;
+    mLastStall = systemTime(SYSTEM_TIME_MONOTONIC);
+    return mLevel > LEVEL_NONE;
+}
@@ -0,0 +1,76 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef MEMORY_PRESSURE_H_
+#define MEMORY_PRESSURE_H_
+
+#include <sys/select.h>
+
+#include <utils/Timers.h>
+
+#include <rfb/Timer.h>
+
+namespace vncflinger {
+
+// Follows memory pressure through PSI triggers on /proc/pressure/memory.
+// Stalls raise the level at once, it drops one step at a time once the
+// system has been free of them for a while. Kernels without PSI stay at
+// LEVEL_NONE.
+class MemoryPressure : public rfb::Timer::Callback {
+  public:
+    enum Level {
+        LEVEL_NONE = 0,
+        // some tasks stall on memory, drop what can be rebuilt
+        LEVEL_TRIM = 1,
+        // all tasks stall on memory, capture less
+        LEVEL_REDUCE = 2,
+    };
+
+    MemoryPressure();
+    virtual ~MemoryPressure();
+
+    // false if PSI is not available
+    bool open();
+    void close();
+
+    int level() const {
+        return mLevel;
+    }
+
+    // select() integration for the server loop, triggers signal as
+    // exceptional conditions
+    void addFds(fd_set* efds);
+    void processEvents(fd_set* efds);
+
+    virtual bool handleTimeout(rfb::Timer* t);
+
+  private:
+    static int openTrigger(const char* trigger);
+
+    void raise(int level);
+
+    static const int kRelaxIntervalMs = 10000;
+
+    int mSomeFd;
+    int mFullFd;
+    int mLevel;
+    nsecs_t mLastStall;
+    rfb::Timer mRelaxTimer;
+};
+};
+
+#endif
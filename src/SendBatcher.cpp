@@ -0,0 +1,81 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#define LOG_TAG "VNC-SendBatcher"
+#include <utils/Log.h>
+
+#include <algorithm>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "SendBatcher.h"
+
+using namespace vncflinger;
+
+bool SendBatcher::isTcp(int fd) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    if (getsockname(fd, (struct sockaddr*)&addr, &len) < 0) {
+        return false;
+    }
+    return addr.ss_family == AF_INET || addr.ss_family == AF_INET6;
+}
+
+void SendBatcher::add(int fd) {
+    // TcpSocket already turns off Nagle, so once uncorked the tail of an
+    // update does not wait for an ack
+    if (!isTcp(fd)) {
+        return;
+    }
+    mTcpFds.push_back(fd);
+    mCorkedFds.reserve(mTcpFds.size());
+}
+
+void SendBatcher::remove(int fd) {
+    std::vector<int>::iterator it = std::find(mTcpFds.begin(), mTcpFds.end(), fd);
+    if (it != mTcpFds.end()) {
+        mTcpFds.erase(it);
+    }
+    it = std::find(mCorkedFds.begin(), mCorkedFds.end(), fd);
+    if (it != mCorkedFds.end()) {
+        mCorkedFds.erase(it);
+    }
+}
+
+void SendBatcher::cork(int fd) {
+    if (std::find(mCorkedFds.begin(), mCorkedFds.end(), fd) != mCorkedFds.end() ||
+        std::find(mTcpFds.begin(), mTcpFds.end(), fd) == mTcpFds.end()) {
+        return;
+    }
+
+    int one = 1;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_CORK, &one, sizeof(one)) == 0) {
+        mCorkedFds.push_back(fd);
+    }
+}
+
+void SendBatcher::uncork() {
+    // clearing the cork sends any partial segment immediately
+    int zero = 0;
+    for (size_t i = 0; i < mCorkedFds.size(); i++) {
+        setsockopt(mCorkedFds[i], IPPROTO_TCP, TCP_CORK, &zero, sizeof(zero));
+    }
+    mCorkedFds.clear();
+}
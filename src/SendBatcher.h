@@ -0,0 +1,49 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#ifndef SEND_BATCHER_H_
+#define SEND_BATCHER_H_
+
+#include <vector>
+
+namespace vncflinger {
+
+// Coalesces everything written to the TCP clients during one pass of the
+// server loop into as few segments as possible. The sockets which are
+// about to be written to are corked while updates are being generated
+// and uncorked once the pass is done, which pushes out the header and
+// all rectangles of an update together. Idle sockets cost no syscalls.
+class SendBatcher {
+  public:
+    // track a newly accepted socket, non-TCP sockets are ignored
+    void add(int fd);
+    void remove(int fd);
+
+    // cork one socket until the next uncork(), if it is tracked
+    void cork(int fd);
+    void uncork();
+
+  private:
+    static bool isTcp(int fd);
+
+    std::vector<int> mTcpFds;
+    std::vector<int> mCorkedFds;
+};
+};
+
+#endif
@@ -0,0 +1,546 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#define LOG_TAG "VNC-SharedFramebuffer"
+#define ATRACE_TAG ATRACE_TAG_GRAPHICS
+#include <utils/Log.h>
+#include <utils/Trace.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <cutils/ashmem.h>
+#include <cutils/sockets.h>
+
+#include <rdr/Exception.h>
+#include <rdr/MemOutStream.h>
+#include <rfb/Configuration.h>
+#include <rfb/Rect.h>
+#include <rfb/util.h>
+
+#include "SharedFramebuffer.h"
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#define MFD_ALLOW_SEALING 0x0002U
+#endif
+
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS (1024 + 9)
+#define F_SEAL_SEAL 0x0001
+#define F_SEAL_SHRINK 0x0002
+#define F_SEAL_GROW 0x0004
+#endif
+
+using namespace vncflinger;
+using namespace android;
+
+static const size_t kMaxRects = LocalFbMessage::MAX_RECTS;
+
+// the same as DemandTimeout, so a worker gives up on its slowest client
+// before the pixels it sends from are rewritten
+static rfb::IntParameter localReaderTimeout("LocalReaderTimeout",
+                                            "Milliseconds a local client may take to read an "
+                                            "update before the pixels are rewritten anyway",
+                                            1000);
+
+SharedFramebuffer::SharedFramebuffer(const char* socketName)
+    : SharedFramebuffer(android_get_control_socket(socketName)) {
+}
+
+SharedFramebuffer::SharedFramebuffer(int listenFd)
+    : mListenFd(listenFd),
+      mBufferFd(-1),
+      mBuffer(NULL),
+      mSize(0),
+      mWidth(0),
+      mHeight(0),
+      mStride(0),
+      mSequence(0),
+      mClientsChanged(false),
+      mReaderTimer(this),
+      mListener(nullptr),
+      mInputListener(nullptr) {
+    if (mListenFd < 0) {
+        throw rdr::Exception("unable to get Android control socket for local framebuffer");
+    }
+    fcntl(mListenFd, F_SETFL, O_NONBLOCK);
+
+    if (listen(mListenFd, 5) < 0) {
+        throw rdr::SystemException("listen", errno);
+    }
+    memset(mFormat, 0, sizeof(mFormat));
+}
+
+SharedFramebuffer::~SharedFramebuffer() {
+    mReaderTimer.stop();
+    for (size_t i = 0; i < mClients.size(); i++) {
+        close(mClients[i].fd);
+    }
+    mClients.clear();
+    release();
+}
+
+void SharedFramebuffer::addFds(fd_set* rfds, fd_set* wfds) {
+    FD_SET(mListenFd, rfds);
+    for (size_t i = 0; i < mClients.size(); i++) {
+        FD_SET(mClients[i].fd, rfds);
+        if (mClients[i].waitWritable) {
+            FD_SET(mClients[i].fd, wfds);
+        }
+    }
+}
+
+void SharedFramebuffer::processEvents(fd_set* rfds, fd_set* wfds) {
+    for (size_t i = mClients.size(); i-- > 0;) {
+        if (FD_ISSET(mClients[i].fd, wfds)) {
+            mClients[i].waitWritable = false;
+        }
+        if (FD_ISSET(mClients[i].fd, rfds)) {
+            readClient(i);
+        }
+    }
+
+    if (FD_ISSET(mListenFd, rfds)) {
+        accept();
+    }
+
+    flush();
+    notifyClientsChanged();
+}
+
+bool SharedFramebuffer::handleTimeout(__unused_attr rfb::Timer* t) {
+    flush();
+    notifyClientsChanged();
+    return false;
+}
+
+void SharedFramebuffer::notifyClientsChanged() {
+    // listeners are only called from the server loop, where the caller
+    // holds no locks, since clients can also be dropped while publishing
+    if (mClientsChanged) {
+        mClientsChanged = false;
+        if (mListener != nullptr) {
+            mListener->onLocalClientsChanged(mClients.size());
+        }
+    }
+}
+
+void SharedFramebuffer::readClient(size_t idx) {
+    Client& client = mClients[idx];
+
+    uint8_t buf[64];
+    ssize_t n = read(client.fd, buf, sizeof(buf));
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+        removeClient(idx);
+        return;
+    }
+
+    for (ssize_t i = 0; i < n; i++) {
+        if (client.inputLen > 0 || (client.canInput && buf[i] == LocalFbInput::MARKER)) {
+            client.input[client.inputLen++] = buf[i];
+            if (client.inputLen == sizeof(LocalFbInput)) {
+                LocalFbInput input;
+                memcpy(&input, client.input, sizeof(input));
+                client.inputLen = 0;
+                dispatchInput(input);
+            }
+        } else {
+            // every other byte is an update request, only the latest one counts
+            client.requested = true;
+            client.reading = false;
+        }
+    }
+}
+
+void SharedFramebuffer::dispatchInput(const LocalFbInput& input) {
+    if (mInputListener == nullptr) {
+        return;
+    }
+    if (input.type == LocalFbInput::TYPE_POINTER) {
+        mInputListener->onLocalPointerEvent(rfb::Point(input.x, input.y), input.buttons);
+    } else if (input.type == LocalFbInput::TYPE_KEY) {
+        mInputListener->onLocalKeyEvent(input.keysym, input.down != 0);
+    }
+}
+
+void SharedFramebuffer::accept() {
+    int fd = accept4(mListenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+        ALOGW("Local client connection failed: %s", strerror(errno));
+        return;
+    }
+
+    // the kernel vouches for the peer. a worker's pid is not reused
+    // while it is our child, even a dead one is left unreaped.
+    struct ucred cred;
+    socklen_t credLen = sizeof(cred);
+    bool canInput = getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credLen) == 0 &&
+                    cred.uid == getuid() &&
+                    std::find(mInputPids.begin(), mInputPids.end(), cred.pid) != mInputPids.end();
+
+    Client client;
+    client.fd = fd;
+    client.requested = false;
+    client.needsBuffer = true;
+    client.canInput = canInput;
+    client.inputLen = 0;
+    client.reading = false;
+    client.readingSince = 0;
+    client.waitWritable = false;
+    if (mBuffer != NULL) {
+        client.damage = rfb::Region(rfb::Rect(0, 0, mWidth, mHeight));
+    }
+    mClients.push_back(client);
+
+    ALOGI("Local client connected (%zu total)%s", mClients.size(),
+          canInput ? ", with input" : "");
+    mClientsChanged = true;
+}
+
+void SharedFramebuffer::removeClient(size_t idx) {
+    close(mClients[idx].fd);
+    mClients.erase(mClients.begin() + idx);
+
+    ALOGI("Local client disconnected (%zu remaining)", mClients.size());
+    if (mClients.empty()) {
+        release();
+    }
+    mClientsChanged = true;
+}
+
+status_t SharedFramebuffer::allocate(const sp<AndroidPixelBuffer>& pb) {
+    release();
+
+    const rfb::PixelFormat& pf = pb->getPF();
+    int width = pb->width();
+    int height = pb->height();
+    int stride = width * pf.bpp / 8;
+    size_t size = (size_t)stride * height;
+    if (size == 0) {
+        return BAD_VALUE;
+    }
+
+    // prefer memfd so the size can be sealed, ashmem on older kernels
+#ifdef __NR_memfd_create
+    mBufferFd = syscall(__NR_memfd_create, "vncflinger-fb", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (mBufferFd >= 0) {
+        if (ftruncate(mBufferFd, size) < 0) {
+            close(mBufferFd);
+            mBufferFd = -1;
+        } else {
+            fcntl(mBufferFd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+        }
+    }
+#endif
+    if (mBufferFd < 0) {
+        mBufferFd = ashmem_create_region("vncflinger-fb", size);
+    }
+    if (mBufferFd < 0) {
+        ALOGE("Failed to allocate shared framebuffer: %s", strerror(errno));
+        return NO_MEMORY;
+    }
+
+    void* addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, mBufferFd, 0);
+    if (addr == MAP_FAILED) {
+        ALOGE("Failed to map shared framebuffer: %s", strerror(errno));
+        close(mBufferFd);
+        mBufferFd = -1;
+        return NO_MEMORY;
+    }
+
+    mBuffer = (uint8_t*)addr;
+    mSize = size;
+    mWidth = width;
+    mHeight = height;
+    mStride = stride;
+    mSource = pb;
+
+    rdr::MemOutStream os(sizeof(mFormat));
+    pf.write(&os);
+    memcpy(mFormat, os.data(), sizeof(mFormat));
+
+    // everything has to be copied and every client needs the new fd
+    rfb::Region all(rfb::Rect(0, 0, mWidth, mHeight));
+    mDirty = all;
+    for (size_t i = 0; i < mClients.size(); i++) {
+        mClients[i].needsBuffer = true;
+        mClients[i].damage = all;
+    }
+
+    ALOGV("Shared framebuffer allocated: %dx%d stride=%d size=%zu", mWidth, mHeight, mStride,
+          mSize);
+    return NO_ERROR;
+}
+
+void SharedFramebuffer::release() {
+    if (mBuffer != NULL) {
+        munmap(mBuffer, mSize);
+        mBuffer = NULL;
+    }
+    if (mBufferFd >= 0) {
+        close(mBufferFd);
+        mBufferFd = -1;
+    }
+    mSize = 0;
+    mWidth = mHeight = mStride = 0;
+    mSource.clear();
+    mDirty.clear();
+}
+
+void SharedFramebuffer::trim() {
+    std::vector<rfb::Rect>().swap(mRects);
+}
+
+void SharedFramebuffer::publish(const sp<AndroidPixelBuffer>& pb, const rfb::Region& changed) {
+    if (mClients.empty()) {
+        return;
+    }
+
+    if (pb != mSource || pb->width() != mWidth || pb->height() != mHeight ||
+        pb->getPF().bpp * pb->width() / 8 != mStride) {
+        if (allocate(pb) != NO_ERROR) {
+            return;
+        }
+    } else {
+        mDirty.assign_union(changed);
+        for (size_t i = 0; i < mClients.size(); i++) {
+            mClients[i].damage.assign_union(changed);
+        }
+    }
+
+    flush();
+}
+
+void SharedFramebuffer::flush() {
+    ATRACE_CALL();
+    if (mBuffer == NULL || mClients.empty()) {
+        return;
+    }
+
+    // pixels may only be rewritten while no client is reading them, a
+    // client which takes too long is not waited for
+    bool copied = mDirty.is_empty();
+    if (!copied) {
+        nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+        nsecs_t timeout = ms2ns(localReaderTimeout);
+        nsecs_t wait = 0;
+        for (size_t i = 0; i < mClients.size(); i++) {
+            const Client& client = mClients[i];
+            if (client.reading && now - client.readingSince < timeout) {
+                wait = std::max(wait, client.readingSince + timeout - now);
+            }
+        }
+        if (wait > 0) {
+            if (!mReaderTimer.isStarted()) {
+                mReaderTimer.start(std::max(1, (int)ns2ms(wait)));
+            }
+        } else {
+            mReaderTimer.stop();
+
+            int bytesPerPixel = mSource->getPF().bpp / 8;
+            mDirty.get_rects(&mRects);
+            for (size_t i = 0; i < mRects.size(); i++) {
+                const rfb::Rect& r = mRects[i];
+                mSource->getImage(mBuffer + r.tl.y * mStride + r.tl.x * bytesPerPixel, r,
+                                  mWidth);
+            }
+            mDirty.clear();
+            mSequence++;
+            copied = true;
+        }
+    }
+
+    // while the copy waits for a reader, the others are still sent damage
+    // which is already in shared memory
+    for (size_t i = mClients.size(); i-- > 0;) {
+        Client& client = mClients[i];
+        status_t res = sendOutput(client);
+        if (res == NO_ERROR && client.requested && !client.damage.is_empty() &&
+            (copied || client.damage.intersect(mDirty).is_empty())) {
+            if (client.needsBuffer) {
+                res = sendBuffer(client);
+            }
+            if (res == NO_ERROR) {
+                res = sendUpdate(client);
+            }
+        }
+        if (res == WOULD_BLOCK) {
+            // tried again once the socket is writable
+            client.waitWritable = true;
+        } else if (res != NO_ERROR) {
+            ALOGW("Failed to send to local client: %s", strerror(errno));
+            removeClient(i);
+        }
+    }
+}
+
+// sends a message, whatever the socket could not take is kept in the
+// client's output. returns the number of bytes sent or -1 on error.
+ssize_t SharedFramebuffer::sendMessage(Client& client, struct msghdr* hdr, size_t len) {
+    ssize_t n = sendmsg(client.fd, hdr, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            return -1;
+        }
+        return 0;
+    }
+
+    // the rest of a partly sent message must follow before anything else
+    size_t skip = n;
+    for (size_t i = 0; i < hdr->msg_iovlen && (size_t)n < len; i++) {
+        const uint8_t* base = (const uint8_t*)hdr->msg_iov[i].iov_base;
+        size_t iovLen = hdr->msg_iov[i].iov_len;
+        if (skip >= iovLen) {
+            skip -= iovLen;
+            continue;
+        }
+        client.output.insert(client.output.end(), base + skip, base + iovLen);
+        skip = 0;
+    }
+    return n;
+}
+
+status_t SharedFramebuffer::sendOutput(Client& client) {
+    if (client.output.empty()) {
+        return NO_ERROR;
+    }
+    if (client.waitWritable) {
+        return WOULD_BLOCK;
+    }
+
+    ssize_t n = send(client.fd, client.output.data(), client.output.size(),
+                     MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            return UNKNOWN_ERROR;
+        }
+        return WOULD_BLOCK;
+    }
+    client.output.erase(client.output.begin(), client.output.begin() + n);
+    return client.output.empty() ? NO_ERROR : WOULD_BLOCK;
+}
+
+status_t SharedFramebuffer::sendBuffer(Client& client) {
+    LocalFbMessage msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.magic = LocalFbMessage::MAGIC;
+    msg.type = LocalFbMessage::TYPE_BUFFER;
+    msg.sequence = mSequence;
+
+    LocalFbBuffer buffer;
+    buffer.width = mWidth;
+    buffer.height = mHeight;
+    buffer.stride = mStride;
+    buffer.size = mSize;
+    memcpy(buffer.format, mFormat, sizeof(buffer.format));
+
+    struct iovec iov[2];
+    iov[0].iov_base = &msg;
+    iov[0].iov_len = sizeof(msg);
+    iov[1].iov_base = &buffer;
+    iov[1].iov_len = sizeof(buffer);
+
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = iov;
+    hdr.msg_iovlen = 2;
+    hdr.msg_control = control;
+    hdr.msg_controllen = sizeof(control);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &mBufferFd, sizeof(int));
+
+    // the descriptor goes out with the first byte, nothing sent means
+    // the whole message is tried again
+    size_t len = sizeof(msg) + sizeof(buffer);
+    ssize_t n = sendMessage(client, &hdr, len);
+    if (n < 0) {
+        return UNKNOWN_ERROR;
+    } else if (n == 0) {
+        return WOULD_BLOCK;
+    }
+
+    client.needsBuffer = false;
+    return (size_t)n < len ? WOULD_BLOCK : NO_ERROR;
+}
+
+status_t SharedFramebuffer::sendUpdate(Client& client) {
+    LocalFbRect rects[kMaxRects];
+    size_t count = 0;
+
+    std::vector<rfb::Rect>& damage = mRects;
+    client.damage.get_rects(&damage);
+    if (damage.size() > kMaxRects) {
+        damage.clear();
+        damage.push_back(client.damage.get_bounding_rect());
+    }
+    for (size_t i = 0; i < damage.size(); i++) {
+        rects[count].x = damage[i].tl.x;
+        rects[count].y = damage[i].tl.y;
+        rects[count].w = damage[i].width();
+        rects[count].h = damage[i].height();
+        count++;
+    }
+
+    LocalFbMessage msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.magic = LocalFbMessage::MAGIC;
+    msg.type = LocalFbMessage::TYPE_UPDATE;
+    msg.sequence = mSequence;
+    msg.count = count;
+
+    // header and rectangles go out in a single write
+    struct iovec iov[2];
+    iov[0].iov_base = &msg;
+    iov[0].iov_len = sizeof(msg);
+    iov[1].iov_base = rects;
+    iov[1].iov_len = count * sizeof(LocalFbRect);
+
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = iov;
+    hdr.msg_iovlen = 2;
+
+    size_t len = iov[0].iov_len + iov[1].iov_len;
+    ssize_t n = sendMessage(client, &hdr, len);
+    if (n < 0) {
+        return UNKNOWN_ERROR;
+    } else if (n == 0) {
+        // damage and request are kept for the next attempt
+        return WOULD_BLOCK;
+    }
+
+    client.damage.clear();
+    client.requested = false;
+    client.reading = true;
+    client.readingSince = systemTime(SYSTEM_TIME_MONOTONIC);
+    return (size_t)n < len ? WOULD_BLOCK : NO_ERROR;
+}
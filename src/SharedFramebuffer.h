@@ -0,0 +1,240 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#ifndef SHARED_FRAMEBUFFER_H_
+#define SHARED_FRAMEBUFFER_H_
+
+#include <sys/select.h>
+#include <sys/socket.h>
+
+#include <sys/types.h>
+
+#include <vector>
+
+#include <utils/Errors.h>
+#include <utils/RefBase.h>
+#include <utils/Timers.h>
+
+#include <rfb/Region.h>
+#include <rfb/Timer.h>
+
+#include "AndroidPixelBuffer.h"
+
+using namespace android;
+
+namespace vncflinger {
+
+// Wire format of the local framebuffer protocol. All values are in host
+// byte order since both ends are on the same machine.
+//
+// When a client connects, and again whenever the framebuffer is
+// reallocated, it receives a BUFFER message carrying the shared memory
+// file descriptor as SCM_RIGHTS ancillary data. The client then writes
+// any single byte other than LocalFbInput::MARKER to request an update,
+// and gets an UPDATE message listing the rectangles which changed since
+// its previous update. The pixels in those rectangles are not modified
+// again until the client sends its next request, or until it has held
+// them longer than LocalReaderTimeout. A client which is that slow no
+// longer holds back the others and may read torn pixels. The area is
+// part of its next update, which repairs them.
+//
+// Worker processes forward input from their RFB clients as LocalFbInput
+// messages, which are injected like input from an RFB client. Only the
+// peers set with setInputPids() may send them. For any other client a
+// MARKER byte is an update request like every other byte, as it was
+// before the workers existed, so it does not swallow the 19 bytes after.
+struct LocalFbMessage {
+    enum { MAGIC = 0x53434e56 /* VNCS */ };
+    enum { TYPE_BUFFER = 1, TYPE_UPDATE = 2 };
+    // beyond this, clients get the bounding box of the damage
+    enum { MAX_RECTS = 64 };
+
+    uint32_t magic;
+    uint32_t type;
+    uint64_t sequence;
+    // number of LocalFbRect following an UPDATE
+    uint32_t count;
+    uint32_t reserved;
+};
+
+struct LocalFbBuffer {
+    uint32_t width;
+    uint32_t height;
+    // bytes per row
+    uint32_t stride;
+    uint32_t size;
+    // PIXEL_FORMAT as defined by RFB
+    uint8_t format[16];
+};
+
+struct LocalFbRect {
+    int32_t x, y, w, h;
+};
+
+struct LocalFbInput {
+    enum { MARKER = 0xff };
+    enum { TYPE_POINTER = 1, TYPE_KEY = 2 };
+
+    uint8_t marker;
+    uint8_t type;
+    // key pressed or released
+    uint8_t down;
+    uint8_t reserved;
+    // pointer position in framebuffer coordinates and RFB button mask
+    int32_t x, y;
+    uint32_t buttons;
+    uint32_t keysym;
+};
+
+// Serves the framebuffer to clients on the same host through shared
+// memory, so they only ever receive damage rectangles over the socket.
+class SharedFramebuffer : public RefBase, public rfb::Timer::Callback {
+  public:
+    SharedFramebuffer(const char* socketName);
+
+    // serve on a bound socket which is not one of init's
+    explicit SharedFramebuffer(int listenFd);
+
+    virtual ~SharedFramebuffer();
+
+    class ClientsChangedListener {
+      public:
+        virtual void onLocalClientsChanged(size_t count) = 0;
+        virtual ~ClientsChangedListener() {
+        }
+    };
+
+    void setClientsChangedListener(ClientsChangedListener* listener) {
+        mListener = listener;
+    }
+
+    class InputListener {
+      public:
+        virtual void onLocalPointerEvent(const rfb::Point& pos, int buttonMask) = 0;
+        virtual void onLocalKeyEvent(uint32_t keysym, bool down) = 0;
+        virtual ~InputListener() {
+        }
+    };
+
+    void setInputListener(InputListener* listener) {
+        mInputListener = listener;
+    }
+
+    // processes allowed to send input, checked when they connect
+    void setInputPids(const std::vector<pid_t>& pids) {
+        mInputPids = pids;
+    }
+
+    bool hasClients() const {
+        return !mClients.empty();
+    }
+
+    // whether any client is waiting for an update
+    bool hasRequests() const {
+        for (size_t i = 0; i < mClients.size(); i++) {
+            if (mClients[i].requested) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // select() integration for the server loop
+    void addFds(fd_set* rfds, fd_set* wfds);
+    void processEvents(fd_set* rfds, fd_set* wfds);
+
+    virtual bool handleTimeout(rfb::Timer* t);
+
+    // free scratch memory, it is allocated again when needed
+    void trim();
+
+    // copy changed pixels into shared memory and notify clients
+    void publish(const sp<AndroidPixelBuffer>& pb, const rfb::Region& changed);
+
+  private:
+    struct Client {
+        int fd;
+        bool requested;
+        bool needsBuffer;
+        rfb::Region damage;
+
+        // an update was sent and no request came back yet
+        bool reading;
+        nsecs_t readingSince;
+
+        // tail of a message the socket could not take, sent before
+        // anything else once it becomes writable
+        std::vector<uint8_t> output;
+        bool waitWritable;
+
+        // one of the input pids, its MARKER bytes start input messages
+        bool canInput;
+
+        // partially received input message
+        uint8_t input[sizeof(LocalFbInput)];
+        size_t inputLen;
+    };
+
+    void accept();
+    void removeClient(size_t idx);
+    void readClient(size_t idx);
+    void dispatchInput(const LocalFbInput& input);
+
+    status_t allocate(const sp<AndroidPixelBuffer>& pb);
+    void release();
+
+    void flush();
+
+    status_t sendBuffer(Client& client);
+    status_t sendUpdate(Client& client);
+    ssize_t sendMessage(Client& client, struct msghdr* hdr, size_t len);
+    status_t sendOutput(Client& client);
+
+    void notifyClientsChanged();
+
+    int mListenFd;
+
+    // shared memory region
+    int mBufferFd;
+    uint8_t* mBuffer;
+    size_t mSize;
+    int mWidth, mHeight, mStride;
+    uint8_t mFormat[16];
+
+    // source of pixels and the area not yet copied from it
+    sp<AndroidPixelBuffer> mSource;
+    rfb::Region mDirty;
+
+    // reused for every update so that it is only allocated once
+    std::vector<rfb::Rect> mRects;
+
+    uint64_t mSequence;
+
+    std::vector<Client> mClients;
+    bool mClientsChanged;
+
+    // flushes again once the slowest reader has timed out
+    rfb::Timer mReaderTimer;
+
+    ClientsChangedListener* mListener;
+    InputListener* mInputListener;
+    std::vector<pid_t> mInputPids;
+};
+};
+
+#endif
@@ -0,0 +1,93 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#define LOG_TAG "VNC-Startup"
+#include <utils/Log.h>
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "StartupTimer.h"
+
+using namespace vncflinger;
+using namespace android;
+
+Mutex StartupTimer::sLock;
+const nsecs_t StartupTimer::sEpoch = systemTime(SYSTEM_TIME_MONOTONIC);
+StartupTimer::Phase StartupTimer::sPhases[kMaxPhases];
+size_t StartupTimer::sNumPhases = 0;
+
+nsecs_t StartupTimer::elapsed() {
+    return systemTime(SYSTEM_TIME_MONOTONIC) - sEpoch;
+}
+
+void StartupTimer::mark(const char* phase) {
+    nsecs_t now = elapsed();
+
+    Mutex::Autolock _l(sLock);
+    if (sNumPhases < kMaxPhases) {
+        sPhases[sNumPhases].name = phase;
+        sPhases[sNumPhases].when = now;
+        sNumPhases++;
+    }
+
+    ALOGI("%-24s +%" PRId64 ".%03" PRId64 "ms", phase, ns2ms(now), ns2us(now) % 1000);
+}
+
+// time between exec() and static initialization, from /proc/self/stat
+nsecs_t StartupTimer::processAge() {
+    FILE* fp = fopen("/proc/self/stat", "r");
+    if (fp == NULL) {
+        return -1;
+    }
+
+    unsigned long long startTicks = 0;
+    int res = fscanf(fp,
+                     "%*d %*s %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u %*d %*d %*d "
+                     "%*d %*d %*d %llu",
+                     &startTicks);
+    fclose(fp);
+    if (res != 1) {
+        return -1;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    nsecs_t bootNow = seconds_to_nanoseconds(ts.tv_sec) + ts.tv_nsec;
+    nsecs_t started = seconds_to_nanoseconds(startTicks) / sysconf(_SC_CLK_TCK);
+
+    return bootNow - started - elapsed();
+}
+
+void StartupTimer::dump() {
+    Mutex::Autolock _l(sLock);
+
+    nsecs_t age = processAge();
+    if (age >= 0) {
+        ALOGI("exec to init: %" PRId64 "ms", ns2ms(age));
+    }
+
+    nsecs_t prev = 0;
+    for (size_t i = 0; i < sNumPhases; i++) {
+        ALOGI("  %-24s at %6" PRId64 "ms (+%" PRId64 "ms)", sPhases[i].name,
+              ns2ms(sPhases[i].when), ns2ms(sPhases[i].when - prev));
+        prev = sPhases[i].when;
+    }
+}
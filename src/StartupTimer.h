@@ -0,0 +1,57 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#ifndef STARTUP_TIMER_H_
+#define STARTUP_TIMER_H_
+
+#include <utils/Mutex.h>
+#include <utils/Timers.h>
+
+namespace vncflinger {
+
+// Records timestamps for the phases of daemon startup and session
+// bring-up so that time-to-first-pixel can be measured from the log.
+class StartupTimer {
+  public:
+    // Record a phase relative to process initialization
+    static void mark(const char* phase);
+
+    // Nanoseconds since process initialization
+    static nsecs_t elapsed();
+
+    // Log a summary of all recorded phases
+    static void dump();
+
+  private:
+    static const size_t kMaxPhases = 32;
+
+    struct Phase {
+        const char* name;
+        nsecs_t when;
+    };
+
+    static nsecs_t processAge();
+
+    static Mutex sLock;
+    static const nsecs_t sEpoch;
+    static Phase sPhases[kMaxPhases];
+    static size_t sNumPhases;
+};
+};
+
+#endif
@@ -0,0 +1,291 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+
+#define LOG_TAG "VNC-ThreadPolicy"
+#include <utils/Log.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <rfb/Configuration.h>
+#include <rfb/util.h>
+
+#include "ThreadPolicy.h"
+
+using namespace vncflinger;
+using namespace android;
+
+static rfb::StringParameter captureCpus("CaptureCpus",
+                                        "CPUs to run frame copy threads on, such as 4-7 "
+                                        "(empty = any)",
+                                        "");
+static rfb::StringParameter serverCpus("ServerCpus",
+                                       "CPUs to run the input and encoding thread on (empty = any)",
+                                       "");
+static rfb::IntParameter capturePriority("CapturePriority",
+                                         "Nice value of frame copy threads (0 = unchanged)", 0);
+static rfb::IntParameter serverPriority("ServerPriority",
+                                        "Nice value of the input and encoding thread "
+                                        "(0 = unchanged)",
+                                        0);
+static rfb::StringParameter cpusetName("Cpuset",
+                                       "Cpuset to move all threads into, such as top-app "
+                                       "(empty = unchanged)",
+                                       "");
+static rfb::IntParameter captureUtilMin("CaptureUtilMin",
+                                        "Minimum utilization hint for frame copy threads, "
+                                        "0-1024 (0 = none)",
+                                        0);
+static rfb::IntParameter serverUtilMin("ServerUtilMin",
+                                       "Minimum utilization hint for the input and encoding "
+                                       "thread, 0-1024 (0 = none)",
+                                       0);
+
+// not yet in the libc headers, see sched_setattr(2)
+struct sched_attr_v1 {
+    uint32_t size;
+    uint32_t sched_policy;
+    uint64_t sched_flags;
+    int32_t sched_nice;
+    uint32_t sched_priority;
+    uint64_t sched_runtime;
+    uint64_t sched_deadline;
+    uint64_t sched_period;
+    uint32_t sched_util_min;
+    uint32_t sched_util_max;
+};
+
+#define SCHED_FLAG_KEEP_POLICY 0x08
+#define SCHED_FLAG_KEEP_PARAMS 0x10
+#define SCHED_FLAG_UTIL_CLAMP_MIN 0x20
+
+Mutex ThreadPolicy::sLock;
+ThreadPolicy::Entry ThreadPolicy::sThreads[ThreadPolicy::kMaxThreads];
+size_t ThreadPolicy::sNumThreads = 0;
+
+static const char* roleName(ThreadPolicy::Role role) {
+    return role == ThreadPolicy::ROLE_CAPTURE ? "capture" : "server";
+}
+
+// parse a list such as "0-3,6" into a mask
+static bool parseCpus(const char* str, cpu_set_t* set) {
+    CPU_ZERO(set);
+    const char* p = str;
+    while (*p != '\0') {
+        char* end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p) {
+            return false;
+        }
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p) {
+                return false;
+            }
+        }
+        if (first < 0 || last < first || last >= CPU_SETSIZE) {
+            return false;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, set);
+        }
+        if (*end == ',') {
+            end++;
+        } else if (*end != '\0') {
+            return false;
+        }
+        p = end;
+    }
+    return CPU_COUNT(set) > 0;
+}
+
+// format a mask back into the "0-3,6" form
+static std::string formatCpus(const cpu_set_t* set) {
+    std::string out;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, set)) {
+            continue;
+        }
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set)) {
+            last++;
+        }
+
+        char range[24];
+        if (last > cpu) {
+            snprintf(range, sizeof(range), "%s%d-%d", out.empty() ? "" : ",", cpu, last);
+        } else {
+            snprintf(range, sizeof(range), "%s%d", out.empty() ? "" : ",", cpu);
+        }
+        out += range;
+        cpu = last;
+    }
+    return out;
+}
+
+// read the first line of a per-thread proc file
+static bool readTaskFile(pid_t tid, const char* file, char* buf, size_t len) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/task/%d/%s", tid, file);
+
+    FILE* fp = fopen(path, "re");
+    if (fp == NULL) {
+        return false;
+    }
+    bool ok = fgets(buf, len, fp) != NULL;
+    fclose(fp);
+    if (ok) {
+        buf[strcspn(buf, "\n")] = '\0';
+    }
+    return ok;
+}
+
+void ThreadPolicy::apply(Role role) {
+    // older host C libraries do not declare gettid()
+    pid_t tid = syscall(SYS_gettid);
+    bool capture = role == ROLE_CAPTURE;
+
+    rfb::CharArray cpus(capture ? captureCpus.getData() : serverCpus.getData());
+    if (cpus.buf[0] != '\0') {
+        setAffinity(tid, cpus.buf);
+    }
+
+    rfb::CharArray cpuset(cpusetName.getData());
+    if (cpuset.buf[0] != '\0') {
+        setCpuset(tid, cpuset.buf);
+    }
+
+    int nice = capture ? capturePriority : serverPriority;
+    if (nice != 0 && setpriority(PRIO_PROCESS, tid, nice) < 0) {
+        ALOGW("Failed to set %s thread priority to %d: %s", roleName(role), nice,
+              strerror(errno));
+    }
+
+    int utilMin = capture ? captureUtilMin : serverUtilMin;
+    if (utilMin > 0) {
+        setUtilClamp(utilMin);
+    }
+
+    remember(tid, role);
+}
+
+void ThreadPolicy::setAffinity(pid_t tid, const char* cpus) {
+    cpu_set_t set;
+    if (!parseCpus(cpus, &set)) {
+        ALOGW("Invalid CPU list: %s", cpus);
+        return;
+    }
+    if (sched_setaffinity(tid, sizeof(set), &set) < 0) {
+        ALOGW("Failed to set affinity of thread %d to %s: %s", tid, cpus, strerror(errno));
+    }
+}
+
+void ThreadPolicy::setCpuset(pid_t tid, const char* cpuset) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "/dev/cpuset/%s/tasks", cpuset);
+
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        ALOGW("Failed to open %s: %s", path, strerror(errno));
+        return;
+    }
+
+    char buf[16];
+    int len = snprintf(buf, sizeof(buf), "%d", tid);
+    if (write(fd, buf, len) < 0) {
+        ALOGW("Failed to move thread %d to cpuset %s: %s", tid, cpuset, strerror(errno));
+    }
+    close(fd);
+}
+
+// only kernels with uclamp support this, the hint is dropped elsewhere
+void ThreadPolicy::setUtilClamp(int utilMin) {
+    struct sched_attr_v1 attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.sched_flags = SCHED_FLAG_KEEP_POLICY | SCHED_FLAG_KEEP_PARAMS | SCHED_FLAG_UTIL_CLAMP_MIN;
+    attr.sched_util_min = std::min(utilMin, 1024);
+
+    if (syscall(__NR_sched_setattr, 0, &attr, 0) < 0) {
+        ALOGW("Failed to set utilization hint %d: %s", utilMin, strerror(errno));
+    }
+}
+
+void ThreadPolicy::remember(pid_t tid, Role role) {
+    Mutex::Autolock _l(sLock);
+
+    // drop threads which have exited, pools are recreated on reconfiguration
+    size_t n = 0;
+    for (size_t i = 0; i < sNumThreads; i++) {
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/self/task/%d", sThreads[i].tid);
+        if (sThreads[i].tid != tid && access(path, F_OK) == 0) {
+            sThreads[n++] = sThreads[i];
+        }
+    }
+    sNumThreads = n;
+
+    if (sNumThreads < kMaxThreads) {
+        sThreads[sNumThreads].tid = tid;
+        sThreads[sNumThreads].role = role;
+        sNumThreads++;
+    }
+}
+
+std::string ThreadPolicy::describe() {
+    Mutex::Autolock _l(sLock);
+
+    std::string out;
+    for (size_t i = 0; i < sNumThreads; i++) {
+        pid_t tid = sThreads[i].tid;
+
+        char name[32];
+        if (!readTaskFile(tid, "comm", name, sizeof(name))) {
+            continue;
+        }
+        char cpuset[64];
+        if (!readTaskFile(tid, "cpuset", cpuset, sizeof(cpuset))) {
+            cpuset[0] = '\0';
+        }
+        cpu_set_t set;
+        if (sched_getaffinity(tid, sizeof(set), &set) < 0) {
+            CPU_ZERO(&set);
+        }
+        errno = 0;
+        int nice = getpriority(PRIO_PROCESS, tid);
+
+        char line[160];
+        snprintf(line, sizeof(line), "%s%s %s/%d cpus=%s nice=%d cpuset=%s",
+                 out.empty() ? "" : "; ", roleName(sThreads[i].role), name, tid,
+                 formatCpus(&set).c_str(), errno == 0 ? nice : 0, cpuset);
+        out += line;
+    }
+    return out;
+}
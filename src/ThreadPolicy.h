@@ -0,0 +1,70 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+
+#ifndef THREAD_POLICY_H_
+#define THREAD_POLICY_H_
+
+#include <sys/types.h>
+
+#include <string>
+
+#include <utils/Mutex.h>
+
+using namespace android;
+
+namespace vncflinger {
+
+// Places threads on cores and sets their priority according to the role
+// they play, so that a busy foreground app cannot push capture and
+// encoding onto the slow cores of a big.LITTLE SoC.
+class ThreadPolicy {
+  public:
+    enum Role {
+        // copies frames out of graphics memory
+        ROLE_CAPTURE,
+        // runs the server loop, which injects input and encodes updates
+        ROLE_SERVER,
+    };
+
+    // Apply the configured placement to the calling thread
+    static void apply(Role role);
+
+    // Effective placement of every thread which called apply()
+    static std::string describe();
+
+  private:
+    static const size_t kMaxThreads = 32;
+
+    struct Entry {
+        pid_t tid;
+        Role role;
+    };
+
+    static void setAffinity(pid_t tid, const char* cpus);
+    static void setCpuset(pid_t tid, const char* cpuset);
+    static void setUtilClamp(int utilMin);
+    static void remember(pid_t tid, Role role);
+
+    static Mutex sLock;
+    static Entry sThreads[kMaxThreads];
+    static size_t sNumThreads;
+};
+};
+
+#endif
@@ -1,50 +1,134 @@
+#ifndef VNC_SERVICE_H_
+#define VNC_SERVICE_H_
+
+#include <stdint.h>
+
+#include <binder/IPCThreadState.h>
+#include <private/android_filesystem_config.h>
+#include <utils/String8.h>
+
 #include "org/chemlab/BnVNCService.h"
 
-#include "VNCFlinger.h"
+#include "AndroidDesktop.h"
 
-namespace android {
+namespace vncflinger {
 
+// Control interface for tuning a running server without dropping sessions.
+// One per display, the first is "vncflinger", the others "vncflinger.<n>"
+// in the order of the Displays parameter. Only root, system and shell may
+// change anything.
 class VNCService : public org::chemlab::BnVNCService {
 
 public:
-    VNCService(sp<VNCFlinger> flinger) : mVNC(flinger) {}
+    VNCService(sp<AndroidDesktop> desktop) : mDesktop(desktop) {}
+
+    static String16 getServiceName(size_t index) {
+        if (index == 0) {
+            return String16("vncflinger");
+        }
+        return String16(String8::format("vncflinger.%zu", index));
+    }
+
+    binder::Status setFrameRateLimit(int32_t fps, bool* ret) {
+        if (!isTrustedCaller()) {
+            return denied();
+        }
+        *ret = fps >= 0;
+        if (*ret) {
+            mDesktop->setFrameRateLimit(fps);
+        }
+        return binder::Status::ok();
+    }
 
-    binder::Status start(bool* ret) {
-        *ret = mVNC->start();
+    binder::Status setCaptureSize(int32_t width, int32_t height, bool* ret) {
+        if (!isTrustedCaller()) {
+            return denied();
+        }
+        *ret = width >= 0 && height >= 0;
+        if (*ret) {
+            mDesktop->setCaptureSize(width, height);
+        }
         return binder::Status::ok();
     }
 
-    binder::Status stop(bool* ret) {
-        *ret = mVNC->stop() == NO_ERROR;
+    binder::Status setWorkerThreads(int32_t threads, bool* ret) {
+        if (!isTrustedCaller()) {
+            return denied();
+        }
+        *ret = threads >= 0;
+        if (*ret) {
+            mDesktop->setWorkerThreads(threads);
+        }
         return binder::Status::ok();
     }
 
-    binder::Status setPort(int32_t port, bool* ret) {
-        *ret = mVNC->setPort(port) == NO_ERROR;
+    binder::Status setLowColor(bool enable, bool* ret) {
+        if (!isTrustedCaller()) {
+            return denied();
+        }
+        mDesktop->setLowColor(enable);
+        *ret = true;
         return binder::Status::ok();
     }
 
-    binder::Status setV4Address(const String16& addr, bool* ret) {
-        *ret = mVNC->setV4Address(String8(addr)) == NO_ERROR;
+    binder::Status setRegionOfInterest(int32_t x, int32_t y, int32_t width, int32_t height,
+                                       bool* ret) {
+        if (!isTrustedCaller()) {
+            return denied();
+        }
+        // each bound on its own, x + width must not overflow
+        *ret = x >= 0 && y >= 0 && width >= 0 && height >= 0 && width <= INT32_MAX - x &&
+               height <= INT32_MAX - y;
+        if (*ret) {
+            mDesktop->setRegionOfInterest(Rect(x, y, x + width, y + height));
+        }
         return binder::Status::ok();
     }
 
-    binder::Status setV6Address(const String16& addr, bool* ret) {
-        *ret = mVNC->setV6Address(String8(addr)) == NO_ERROR;
+    binder::Status setDisplayPowerState(int32_t state, bool* ret) {
+        if (!isTrustedCaller()) {
+            return denied();
+        }
+        *ret = state >= DISPLAY_STATE_OFF && state <= DISPLAY_STATE_DOZE_SUSPEND;
+        if (*ret) {
+            mDesktop->setDisplayPowerState(state);
+        }
         return binder::Status::ok();
     }
 
-    binder::Status setPassword(const String16& addr, bool* ret) {
-        *ret = mVNC->setPassword(String8(addr)) == NO_ERROR;
+    binder::Status typeText(const String16& text, int32_t* ret) {
+        if (!isTrustedCaller()) {
+            return denied();
+        }
+        *ret = mDesktop->typeText(text);
         return binder::Status::ok();
     }
 
-    binder::Status clearPassword(bool* ret) {
-        *ret = mVNC->clearPassword() == NO_ERROR;
+    binder::Status setParameter(const String16& name, const String16& value, bool* ret) {
+        if (!isTrustedCaller()) {
+            return denied();
+        }
+        *ret = mDesktop->setParameter(String8(name).string(), String8(value).string());
+        return binder::Status::ok();
+    }
+
+    binder::Status getStats(org::chemlab::VNCStats* stats) {
+        mDesktop->getStats(stats);
         return binder::Status::ok();
     }
 
 private:
-    sp<VNCFlinger> mVNC;
+    static bool isTrustedCaller() {
+        uid_t uid = IPCThreadState::self()->getCallingUid();
+        return uid == AID_ROOT || uid == AID_SYSTEM || uid == AID_SHELL;
+    }
+
+    static binder::Status denied() {
+        return binder::Status::fromExceptionCode(binder::Status::EX_SECURITY);
+    }
+
+    sp<AndroidDesktop> mDesktop;
 };
 };
+
+#endif
@@ -0,0 +1,117 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "VNCStats.h"
+
+using namespace android;
+using namespace org::chemlab;
+
+VNCStats::VNCStats()
+    : uptimeMs(0),
+      clients(0),
+      captureWidth(0),
+      captureHeight(0),
+      viewportWidth(0),
+      viewportHeight(0),
+      frameRateLimit(0),
+      workerThreads(0),
+      bitsPerPixel(0),
+      displayPowerState(0),
+      memoryPressure(0),
+      framesCaptured(0),
+      framesDropped(0),
+      framesUnchanged(0),
+      framesStale(0),
+      damagedPixels(0),
+      copyTimeLastUs(0),
+      copyTimeMaxUs(0),
+      copyTimeTotalUs(0),
+      frameLatencyLastUs(0),
+      frameLatencyMaxUs(0),
+      frameNewCalls(0),
+      timeToFirstFrameMs(0),
+      stallsRecovered(0),
+      recoveryTimeLastMs(0),
+      inputDeviceRetries(0) {
+}
+
+// fields are written in declaration order, readers must match
+status_t VNCStats::writeToParcel(Parcel* parcel) const {
+    parcel->writeInt64(uptimeMs);
+    parcel->writeInt32(clients);
+    parcel->writeInt32(captureWidth);
+    parcel->writeInt32(captureHeight);
+    parcel->writeInt32(viewportWidth);
+    parcel->writeInt32(viewportHeight);
+    parcel->writeInt32(frameRateLimit);
+    parcel->writeInt32(workerThreads);
+    parcel->writeInt32(bitsPerPixel);
+    parcel->writeInt32(displayPowerState);
+    parcel->writeInt32(memoryPressure);
+    parcel->writeInt64(framesCaptured);
+    parcel->writeInt64(framesDropped);
+    parcel->writeInt64(framesUnchanged);
+    parcel->writeInt64(framesStale);
+    parcel->writeInt64(damagedPixels);
+    parcel->writeInt64(copyTimeLastUs);
+    parcel->writeInt64(copyTimeMaxUs);
+    parcel->writeInt64(copyTimeTotalUs);
+    parcel->writeInt64(frameLatencyLastUs);
+    parcel->writeInt64(frameLatencyMaxUs);
+    parcel->writeInt64(frameNewCalls);
+    parcel->writeInt64(timeToFirstFrameMs);
+    parcel->writeInt64(stallsRecovered);
+    parcel->writeInt64(recoveryTimeLastMs);
+    parcel->writeInt32(inputDeviceRetries);
+    return parcel->writeString16(threadPlacement);
+}
+
+status_t VNCStats::readFromParcel(const Parcel* parcel) {
+    // stops at the first field which could not be read
+    status_t res;
+    if ((res = parcel->readInt64(&uptimeMs)) != OK ||
+        (res = parcel->readInt32(&clients)) != OK ||
+        (res = parcel->readInt32(&captureWidth)) != OK ||
+        (res = parcel->readInt32(&captureHeight)) != OK ||
+        (res = parcel->readInt32(&viewportWidth)) != OK ||
+        (res = parcel->readInt32(&viewportHeight)) != OK ||
+        (res = parcel->readInt32(&frameRateLimit)) != OK ||
+        (res = parcel->readInt32(&workerThreads)) != OK ||
+        (res = parcel->readInt32(&bitsPerPixel)) != OK ||
+        (res = parcel->readInt32(&displayPowerState)) != OK ||
+        (res = parcel->readInt32(&memoryPressure)) != OK ||
+        (res = parcel->readInt64(&framesCaptured)) != OK ||
+        (res = parcel->readInt64(&framesDropped)) != OK ||
+        (res = parcel->readInt64(&framesUnchanged)) != OK ||
+        (res = parcel->readInt64(&framesStale)) != OK ||
+        (res = parcel->readInt64(&damagedPixels)) != OK ||
+        (res = parcel->readInt64(&copyTimeLastUs)) != OK ||
+        (res = parcel->readInt64(&copyTimeMaxUs)) != OK ||
+        (res = parcel->readInt64(&copyTimeTotalUs)) != OK ||
+        (res = parcel->readInt64(&frameLatencyLastUs)) != OK ||
+        (res = parcel->readInt64(&frameLatencyMaxUs)) != OK ||
+        (res = parcel->readInt64(&frameNewCalls)) != OK ||
+        (res = parcel->readInt64(&timeToFirstFrameMs)) != OK ||
+        (res = parcel->readInt64(&stallsRecovered)) != OK ||
+        (res = parcel->readInt64(&recoveryTimeLastMs)) != OK ||
+        (res = parcel->readInt32(&inputDeviceRetries)) != OK ||
+        (res = parcel->readString16(&threadPlacement)) != OK) {
+        return res;
+    }
+    return OK;
+}
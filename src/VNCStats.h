@@ -0,0 +1,91 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#ifndef VNC_STATS_H_
+#define VNC_STATS_H_
+
+#include <binder/Parcel.h>
+#include <binder/Parcelable.h>
+#include <utils/String16.h>
+
+namespace org {
+namespace chemlab {
+
+// Performance counters returned by IVNCService.getStats()
+class VNCStats : public android::Parcelable {
+  public:
+    VNCStats();
+    virtual ~VNCStats() {
+    }
+
+    virtual android::status_t writeToParcel(android::Parcel* parcel) const;
+    virtual android::status_t readFromParcel(const android::Parcel* parcel);
+
+    int64_t uptimeMs;
+    int32_t clients;
+
+    // the captured framebuffer, and the part of it showing the display
+    int32_t captureWidth;
+    int32_t captureHeight;
+    int32_t viewportWidth;
+    int32_t viewportHeight;
+    int32_t frameRateLimit;
+    int32_t workerThreads;
+    int32_t bitsPerPixel;
+    int32_t displayPowerState;
+    int32_t memoryPressure;
+
+    int64_t framesCaptured;
+    int64_t framesDropped;
+    int64_t framesUnchanged;
+    int64_t framesStale;
+    // area of the tiles which changed, a tile counts in full even if
+    // only one of its pixels did
+    int64_t damagedPixels;
+
+    int64_t copyTimeLastUs;
+    int64_t copyTimeMaxUs;
+    int64_t copyTimeTotalUs;
+
+    // from composition to the start of the copy
+    int64_t frameLatencyLastUs;
+    int64_t frameLatencyMaxUs;
+
+    // calls to operator new by the last frame, only counted in builds
+    // with VNCFLINGER_COUNT_ALLOCATIONS. malloc from C code, such as the
+    // regions of libtigervnc, is not included.
+    int64_t frameNewCalls;
+
+    int64_t timeToFirstFrameMs;
+
+    // capture pipeline rebuilds, and how long the last one took to
+    // produce a frame
+    int64_t stallsRecovered;
+    int64_t recoveryTimeLastMs;
+
+    // attempts to reopen the input device since it failed, 0 while it
+    // works
+    int32_t inputDeviceRetries;
+
+    // role, name, tid, cpus, nice and cpuset of each pipeline thread
+    android::String16 threadPlacement;
+};
+};
+};
+
+#endif
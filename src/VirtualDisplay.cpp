@@ -27,26 +27,25 @@
 
 using namespace vncflinger;
 
-VirtualDisplay::VirtualDisplay(DisplayInfo* info, uint32_t width, uint32_t height,
+// sourceRect is the area of the layer stack to capture, in the
+// coordinates of the display's current orientation
+VirtualDisplay::VirtualDisplay(const Rect& sourceRect, uint32_t width, uint32_t height,
+                               uint32_t layerStack, PixelFormat format,
                                sp<CpuConsumer::FrameAvailableListener> listener) {
     mWidth = width;
     mHeight = height;
-
-    if (info->orientation == DISPLAY_ORIENTATION_0 || info->orientation == DISPLAY_ORIENTATION_180) {
-        mSourceRect = Rect(info->w, info->h);
-    } else {
-        mSourceRect = Rect(info->h, info->w);
-    }
+    mSourceRect = sourceRect;
 
     Rect displayRect = getDisplayRect();
 
     sp<IGraphicBufferConsumer> consumer;
     BufferQueue::createBufferQueue(&mProducer, &consumer);
-    mCpuConsumer = new CpuConsumer(consumer, 1);
+    // one buffer may be held back while the next one is locked
+    mCpuConsumer = new CpuConsumer(consumer, 2);
     mCpuConsumer->setName(String8("vds-to-cpu"));
     mCpuConsumer->setDefaultBufferSize(width, height);
     mProducer->setMaxDequeuedBufferCount(4);
-    consumer->setDefaultBufferFormat(PIXEL_FORMAT_RGBX_8888);
+    consumer->setDefaultBufferFormat(format);
 
     mCpuConsumer->setFrameAvailableListener(listener);
 
@@ -56,7 +55,7 @@ VirtualDisplay::VirtualDisplay(DisplayInfo* info, uint32_t width, uint32_t heigh
     SurfaceComposerClient::setDisplaySurface(mDpy, mProducer);
 
     SurfaceComposerClient::setDisplayProjection(mDpy, 0, mSourceRect, displayRect);
-    SurfaceComposerClient::setDisplayLayerStack(mDpy, 0);  // default stack
+    SurfaceComposerClient::setDisplayLayerStack(mDpy, layerStack);
     SurfaceComposerClient::closeGlobalTransaction();
 
     ALOGV("Virtual display (%ux%u [viewport=%ux%u] created", width, height, displayRect.getWidth(),
@@ -71,6 +70,17 @@ VirtualDisplay::~VirtualDisplay() {
     ALOGV("Virtual display destroyed");
 }
 
+void VirtualDisplay::setSourceRect(const Rect& sourceRect) {
+    mSourceRect = sourceRect;
+
+    SurfaceComposerClient::openGlobalTransaction();
+    SurfaceComposerClient::setDisplayProjection(mDpy, 0, mSourceRect, getDisplayRect());
+    SurfaceComposerClient::closeGlobalTransaction();
+
+    ALOGV("Virtual display source changed to [%d,%d,%d,%d]", mSourceRect.left, mSourceRect.top,
+          mSourceRect.right, mSourceRect.bottom);
+}
+
 Rect VirtualDisplay::getDisplayRect() {
     uint32_t outWidth, outHeight;
     if (mWidth > (uint32_t)((float)mWidth * aspectRatio())) {
@@ -24,6 +24,7 @@
 #include <gui/IGraphicBufferProducer.h>
 
 #include <ui/DisplayInfo.h>
+#include <ui/PixelFormat.h>
 #include <ui/Rect.h>
 
 using namespace android;
@@ -32,8 +33,8 @@ namespace vncflinger {
 
 class VirtualDisplay : public RefBase {
   public:
-    VirtualDisplay(DisplayInfo* info, uint32_t width, uint32_t height,
-                   sp<CpuConsumer::FrameAvailableListener> listener);
+    VirtualDisplay(const Rect& sourceRect, uint32_t width, uint32_t height, uint32_t layerStack,
+                   PixelFormat format, sp<CpuConsumer::FrameAvailableListener> listener);
 
     virtual ~VirtualDisplay();
 
@@ -43,6 +44,9 @@ class VirtualDisplay : public RefBase {
         return mSourceRect;
     }
 
+    // project a different part of the layer stack at the same size
+    virtual void setSourceRect(const Rect& sourceRect);
+
     CpuConsumer* getConsumer() {
         return mCpuConsumer.get();
     }
@@ -0,0 +1,319 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+
+#define LOG_TAG "VNC-WorkerDesktop"
+#include <utils/Log.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <rdr/Exception.h>
+#include <rdr/MemInStream.h>
+#include <rfb/PixelFormat.h>
+#include <rfb/ScreenSet.h>
+#include <rfb/Region.h>
+#include <rfb/util.h>
+
+#include "WorkerDesktop.h"
+
+using namespace vncflinger;
+
+WorkerDesktop::WorkerDesktop(const char* socketPath)
+    : mSocketPath(socketPath),
+      mFd(-1),
+      mServer(NULL),
+      mInputLen(0),
+      mInputFd(-1),
+      mBuffer(NULL),
+      mSize(0),
+      mUpdatePending(false) {
+}
+
+WorkerDesktop::~WorkerDesktop() {
+    disconnect();
+}
+
+void WorkerDesktop::start(rfb::VNCServer* vs) {
+    // clients are only handed to the server once the buffer is mapped
+    if (mPixels == NULL) {
+        throw rdr::Exception("no framebuffer from the capture process");
+    }
+    mServer = vs;
+    mServer->setPixelBuffer(mPixels.get(), mLayout);
+    ALOGV("Worker desktop started");
+}
+
+void WorkerDesktop::stop() {
+    mServer->setPixelBuffer(0);
+    mServer = NULL;
+    disconnect();
+}
+
+unsigned int WorkerDesktop::setScreenLayout(__unused_attr int fb_width,
+                                            __unused_attr int fb_height,
+                                            __unused_attr const rfb::ScreenSet& layout) {
+    // the capture process owns the size
+    return rfb::resultProhibited;
+}
+
+void WorkerDesktop::keyEvent(rdr::U32 keysym, __unused_attr rdr::U32 keycode, bool down) {
+    LocalFbInput input;
+    memset(&input, 0, sizeof(input));
+    input.marker = LocalFbInput::MARKER;
+    input.type = LocalFbInput::TYPE_KEY;
+    input.down = down;
+    input.keysym = keysym;
+    sendInput(input);
+}
+
+void WorkerDesktop::pointerEvent(const rfb::Point& pos, int buttonMask) {
+    LocalFbInput input;
+    memset(&input, 0, sizeof(input));
+    input.marker = LocalFbInput::MARKER;
+    input.type = LocalFbInput::TYPE_POINTER;
+    input.x = pos.x;
+    input.y = pos.y;
+    input.buttons = buttonMask;
+    sendInput(input);
+}
+
+void WorkerDesktop::addFds(fd_set* rfds) {
+    if (mFd >= 0) {
+        FD_SET(mFd, rfds);
+    }
+}
+
+void WorkerDesktop::processEvents(fd_set* rfds) {
+    if (mFd < 0 || !FD_ISSET(mFd, rfds)) {
+        return;
+    }
+    if (!readMessages()) {
+        ALOGW("Lost the capture process");
+        if (mServer != NULL) {
+            // the server still uses the mapping until stop()
+            close(mFd);
+            mFd = -1;
+            mUpdatePending = false;
+            mServer->closeClients("Capture process went away");
+        } else {
+            disconnect();
+        }
+    }
+}
+
+void WorkerDesktop::requestUpdate() {
+    if (mFd < 0 || !mUpdatePending) {
+        return;
+    }
+    char request = 'R';
+    if (write(mFd, &request, 1) == 1) {
+        mUpdatePending = false;
+    }
+}
+
+bool WorkerDesktop::connectToCapture() {
+    if (mFd >= 0) {
+        return true;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, mSocketPath.c_str(), sizeof(addr.sun_path) - 1);
+
+    // a full backlog or a capture process which is not up yet are both
+    // tried again by the worker loop
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return false;
+    }
+
+    // reads never wait, writes are a few bytes and may
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    mFd = fd;
+    mInputLen = 0;
+
+    // the capture process starts capturing now, the buffer and a full
+    // update come with the first request
+    mUpdatePending = true;
+    requestUpdate();
+    return true;
+}
+
+void WorkerDesktop::disconnect() {
+    if (mFd >= 0) {
+        close(mFd);
+        mFd = -1;
+    }
+    if (mInputFd >= 0) {
+        close(mInputFd);
+        mInputFd = -1;
+    }
+    mInputLen = 0;
+    mPixels.reset();
+    unmapBuffer();
+    mUpdatePending = false;
+}
+
+bool WorkerDesktop::readMessages() {
+    for (;;) {
+        struct iovec iov;
+        iov.iov_base = mInput + mInputLen;
+        iov.iov_len = sizeof(mInput) - mInputLen;
+
+        char control[CMSG_SPACE(sizeof(int))];
+        struct msghdr hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_iov = &iov;
+        hdr.msg_iovlen = 1;
+        hdr.msg_control = control;
+        hdr.msg_controllen = sizeof(control);
+
+        ssize_t n = recvmsg(mFd, &hdr, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            return true;
+        } else if (n <= 0) {
+            return false;
+        }
+
+        // only BUFFER messages carry a descriptor, on their first byte
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+        if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            if (mInputFd >= 0) {
+                close(mInputFd);
+            }
+            memcpy(&mInputFd, CMSG_DATA(cmsg), sizeof(int));
+        }
+        mInputLen += n;
+
+        // hand on every whole message, the rest waits for more bytes
+        size_t used = 0;
+        while (mInputLen - used >= sizeof(LocalFbMessage)) {
+            LocalFbMessage msg;
+            memcpy(&msg, mInput + used, sizeof(msg));
+            if (msg.magic != LocalFbMessage::MAGIC ||
+                (msg.type == LocalFbMessage::TYPE_UPDATE &&
+                 msg.count > LocalFbMessage::MAX_RECTS)) {
+                return false;
+            }
+
+            size_t len = sizeof(msg);
+            if (msg.type == LocalFbMessage::TYPE_BUFFER) {
+                len += sizeof(LocalFbBuffer);
+            } else if (msg.type == LocalFbMessage::TYPE_UPDATE) {
+                len += msg.count * sizeof(LocalFbRect);
+            } else {
+                return false;
+            }
+            if (mInputLen - used < len) {
+                break;
+            }
+            if (!handleMessage(msg, mInput + used + sizeof(msg))) {
+                return false;
+            }
+            used += len;
+        }
+        memmove(mInput, mInput + used, mInputLen - used);
+        mInputLen -= used;
+    }
+}
+
+bool WorkerDesktop::handleMessage(const LocalFbMessage& msg, const uint8_t* body) {
+    if (msg.type == LocalFbMessage::TYPE_BUFFER) {
+        LocalFbBuffer buffer;
+        memcpy(&buffer, body, sizeof(buffer));
+        int fd = mInputFd;
+        mInputFd = -1;
+        return fd >= 0 && mapBuffer(buffer, fd);
+    }
+
+    rfb::Region changed;
+    for (uint32_t i = 0; i < msg.count; i++) {
+        LocalFbRect r;
+        memcpy(&r, body + i * sizeof(r), sizeof(r));
+        changed.assign_union(rfb::Region(rfb::Rect(r.x, r.y, r.x + r.w, r.y + r.h)));
+    }
+
+    if (mPixels != NULL && mServer != NULL) {
+        mServer->add_changed(changed.intersect(mPixels->getRect()));
+    }
+    mUpdatePending = true;
+    return true;
+}
+
+bool WorkerDesktop::mapBuffer(const LocalFbBuffer& buffer, int fd) {
+    void* addr = mmap(NULL, buffer.size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        ALOGE("Failed to map shared framebuffer: %s", strerror(errno));
+        return false;
+    }
+
+    rfb::PixelFormat pf;
+    rdr::MemInStream is(buffer.format, sizeof(buffer.format));
+    pf.read(&is);
+
+    std::unique_ptr<rfb::FullFramePixelBuffer> pixels(new rfb::FullFramePixelBuffer(
+        pf, buffer.width, buffer.height, (rdr::U8*)addr, buffer.stride / (pf.bpp / 8)));
+
+    rfb::ScreenSet layout;
+    layout.add_screen(rfb::Screen(0, 0, 0, buffer.width, buffer.height, 0));
+
+    // the server lets go of the old buffer before it is unmapped
+    if (mServer != NULL) {
+        mServer->setPixelBuffer(pixels.get(), layout);
+    }
+    mPixels = std::move(pixels);
+    mLayout = layout;
+    unmapBuffer();
+
+    mBuffer = (uint8_t*)addr;
+    mSize = buffer.size;
+    ALOGV("Mapped shared framebuffer: %ux%u", buffer.width, buffer.height);
+    return true;
+}
+
+void WorkerDesktop::unmapBuffer() {
+    if (mBuffer != NULL) {
+        munmap(mBuffer, mSize);
+        mBuffer = NULL;
+        mSize = 0;
+    }
+}
+
+void WorkerDesktop::sendInput(const LocalFbInput& input) {
+    if (mFd < 0) {
+        return;
+    }
+    if (write(mFd, &input, sizeof(input)) != sizeof(input)) {
+        ALOGW("Failed to forward input: %s", strerror(errno));
+    }
+}
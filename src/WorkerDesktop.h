@@ -0,0 +1,118 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+
+#ifndef WORKER_DESKTOP_H_
+#define WORKER_DESKTOP_H_
+
+#include <sys/select.h>
+
+#include <memory>
+#include <string>
+
+#include <rfb/PixelBuffer.h>
+#include <rfb/SDesktop.h>
+#include <rfb/ScreenSet.h>
+#include <rfb/VNCServer.h>
+
+#include "SharedFramebuffer.h"
+
+namespace vncflinger {
+
+// Desktop of a worker process. Frames and damage come from the capture
+// process through the local framebuffer socket and its shared memory,
+// and input is forwarded back the same way, so any number of workers
+// can serve clients from a single capture.
+//
+// The worker loop connects before handing clients to the server, and
+// only does so once the framebuffer is mapped, so start() never waits.
+class WorkerDesktop : public rfb::SDesktop {
+  public:
+    WorkerDesktop(const char* socketPath);
+    virtual ~WorkerDesktop();
+
+    virtual void start(rfb::VNCServer* vs);
+    virtual void stop();
+
+    virtual unsigned int setScreenLayout(int fb_width, int fb_height, const rfb::ScreenSet& layout);
+
+    virtual void keyEvent(rdr::U32 keysym, rdr::U32 keycode, bool down);
+    virtual void pointerEvent(const rfb::Point& pos, int buttonMask);
+
+    // one attempt which does not wait, false until it succeeds. the
+    // first update is requested right away.
+    bool connectToCapture();
+
+    bool isConnected() const {
+        return mFd >= 0;
+    }
+
+    // also unmaps the framebuffer, so not while the server is started
+    void disconnect();
+
+    // the framebuffer is mapped, clients can be served
+    bool isReady() const {
+        return mPixels != NULL;
+    }
+
+    // select() integration for the worker loop
+    void addFds(fd_set* rfds);
+    void processEvents(fd_set* rfds);
+
+    // an update arrived and was not requested again, the capture process
+    // leaves its pixels alone until then
+    bool hasUpdate() const {
+        return mUpdatePending;
+    }
+
+    // ask for the next update once the server has sent the last one to
+    // all of its clients
+    void requestUpdate();
+
+  private:
+    // reads whatever has arrived without blocking, false on errors
+    bool readMessages();
+    bool handleMessage(const LocalFbMessage& msg, const uint8_t* body);
+    bool mapBuffer(const LocalFbBuffer& buffer, int fd);
+    void unmapBuffer();
+
+    void sendInput(const LocalFbInput& input);
+
+    std::string mSocketPath;
+    int mFd;
+
+    rfb::VNCServer* mServer;
+
+    // received bytes which do not make a whole message yet, and the
+    // descriptor sent along with the next BUFFER message
+    uint8_t mInput[sizeof(LocalFbMessage) + LocalFbMessage::MAX_RECTS * sizeof(LocalFbRect)];
+    size_t mInputLen;
+    int mInputFd;
+
+    // mapping of the shared framebuffer
+    uint8_t* mBuffer;
+    size_t mSize;
+    std::unique_ptr<rfb::FullFramePixelBuffer> mPixels;
+    rfb::ScreenSet mLayout;
+
+    // an update arrived and has not been requested again
+    bool mUpdatePending;
+};
+};
+
+#endif
@@ -0,0 +1,127 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#define LOG_TAG "VNC-WorkerPool"
+#include <utils/Log.h>
+
+#include <pthread.h>
+#include <stdio.h>
+
+#include "WorkerPool.h"
+
+using namespace vncflinger;
+
+WorkerPool::WorkerPool(size_t threads, const char* name, void (*init)())
+    : mName(name), mJob(NULL), mGeneration(0), mActive(0), mExit(false) {
+    for (size_t i = 0; i < threads; i++) {
+        mThreads.push_back(std::thread(&WorkerPool::threadLoop, this, init));
+
+        char threadName[16];
+        snprintf(threadName, sizeof(threadName), "%s-%zu", name, i);
+        pthread_setname_np(mThreads.back().native_handle(), threadName);
+    }
+    ALOGV("Started %zu %s workers", threads, name);
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard<std::mutex> _l(mMutex);
+        mExit = true;
+    }
+    mWorkCond.notify_all();
+
+    for (size_t i = 0; i < mThreads.size(); i++) {
+        mThreads[i].join();
+    }
+}
+
+void WorkerPool::run(Task task, void* arg, size_t count) {
+    if (count == 0) {
+        return;
+    }
+
+    if (mThreads.empty() || count == 1) {
+        for (size_t i = 0; i < count; i++) {
+            task(arg, i);
+        }
+        return;
+    }
+
+    Job job;
+    job.task = task;
+    job.arg = arg;
+    job.count = count;
+    job.next = 0;
+    job.done = 0;
+
+    {
+        std::lock_guard<std::mutex> _l(mMutex);
+        mJob = &job;
+        mGeneration++;
+    }
+    mWorkCond.notify_all();
+
+    work(&job);
+
+    // the job lives on this stack, so wait for every worker to leave it
+    std::unique_lock<std::mutex> _l(mMutex);
+    while (job.done < count || mActive > 0) {
+        mDoneCond.wait(_l);
+    }
+    mJob = NULL;
+}
+
+void WorkerPool::work(Job* job) {
+    for (;;) {
+        size_t i = job->next.fetch_add(1);
+        if (i >= job->count) {
+            break;
+        }
+        job->task(job->arg, i);
+        job->done.fetch_add(1);
+    }
+}
+
+void WorkerPool::threadLoop(void (*init)()) {
+    uint64_t seen = 0;
+
+    if (init != NULL) {
+        init();
+    }
+
+    std::unique_lock<std::mutex> _l(mMutex);
+    for (;;) {
+        while (!mExit && (mGeneration == seen || mJob == NULL)) {
+            mWorkCond.wait(_l);
+        }
+        if (mExit) {
+            break;
+        }
+        seen = mGeneration;
+
+        Job* job = mJob;
+        mActive++;
+        _l.unlock();
+
+        work(job);
+
+        _l.lock();
+        mActive--;
+        mDoneCond.notify_all();
+    }
+}
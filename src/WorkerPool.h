@@ -0,0 +1,76 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#ifndef WORKER_POOL_H_
+#define WORKER_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace vncflinger {
+
+// Small set of persistent threads for splitting one piece of work, such
+// as a frame copy, across cores. The calling thread takes part in the
+// work and run() returns once all of it has completed.
+class WorkerPool {
+  public:
+    typedef void (*Task)(void* arg, size_t index);
+
+    // init is called on each new thread before it takes any work
+    WorkerPool(size_t threads, const char* name, void (*init)() = NULL);
+    ~WorkerPool();
+
+    // number of threads available to run(), including the caller
+    size_t concurrency() const {
+        return mThreads.size() + 1;
+    }
+
+    // call task(arg, i) for every i in [0, count)
+    void run(Task task, void* arg, size_t count);
+
+  private:
+    struct Job {
+        Task task;
+        void* arg;
+        size_t count;
+        std::atomic<size_t> next;
+        std::atomic<size_t> done;
+    };
+
+    void threadLoop(void (*init)());
+    void work(Job* job);
+
+    std::vector<std::thread> mThreads;
+    std::string mName;
+
+    std::mutex mMutex;
+    std::condition_variable mWorkCond;
+    std::condition_variable mDoneCond;
+
+    Job* mJob;
+    uint64_t mGeneration;
+    size_t mActive;
+    bool mExit;
+};
+};
+
+#endif
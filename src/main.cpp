@@ -1,11 +1,32 @@
 #define LOG_TAG "VNCFlinger"
+#define ATRACE_TAG ATRACE_TAG_GRAPHICS
 #include <utils/Log.h>
+#include <utils/Trace.h>
 
 #include <fcntl.h>
 #include <inttypes.h>
-
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <algorithm>
+#include <future>
+#include <map>
+#include <vector>
+
+#include "AllocCounter.h"
 #include "AndroidDesktop.h"
 #include "AndroidSocket.h"
+#include "MemoryPressure.h"
+#include "SendBatcher.h"
+#include "SharedFramebuffer.h"
+#include "StartupTimer.h"
+#include "ThreadPolicy.h"
+#include "VNCService.h"
+#include "WorkerDesktop.h"
+#include "WorkerPool.h"
 
 #include <binder/IPCThreadState.h>
 #include <binder/IServiceManager.h>
@@ -20,6 +41,7 @@
 #include <rfb/util.h>
 
 #include <cutils/properties.h>
+#include <cutils/sockets.h>
 
 
 using namespace vncflinger;
@@ -27,6 +49,7 @@ using namespace android;
 
 static char* gProgramName;
 static bool gCaughtSignal = false;
+static int gChildPipe[2] = {-1, -1};
 static char gSerialNo[PROPERTY_VALUE_MAX];
 
 #ifndef DESKTOP_NAME
@@ -37,6 +60,31 @@ static rfb::IntParameter rfbport("rfbport", "TCP port to listen for RFB protocol
 static rfb::BoolParameter localhostOnly("localhost", "Only allow connections from localhost", false);
 static rfb::StringParameter rfbunixpath("rfbunixpath", "Unix socket to listen for RFB protocol", "");
 static rfb::IntParameter rfbunixmode("rfbunixmode", "Unix socket access mode", 0600);
+static rfb::StringParameter displays("Displays",
+                                      "Displays to serve as id[:layerstack], separated by commas. "
+                                      "Each additional display listens on the next TCP port",
+                                      "0");
+static rfb::BoolParameter localFramebuffer("LocalFramebuffer",
+                                           "Serve a shared memory framebuffer to local clients "
+                                           "on the vncflinger_fb socket",
+                                           false);
+static rfb::IntParameter workers("Workers",
+                                  "Number of worker processes serving TCP clients from the "
+                                  "local framebuffer, sharing rfbport (0 = none)",
+                                  0);
+static rfb::IntParameter inputPollInterval("InputPollInterval",
+                                           "Milliseconds of frame and output work after which "
+                                           "pending input is handled first",
+                                           4);
+static rfb::IntParameter demandTimeout("DemandTimeout",
+                                       "Milliseconds a client of a worker process which has not "
+                                       "asked for an update since its last one may hold back "
+                                       "the next",
+                                       1000);
+static rfb::BoolParameter memoryPressure("MemoryPressure",
+                                         "Shed memory while the system is short of it, using "
+                                         "pressure stall information",
+                                         true);
 
 static void printVersion(FILE* fp) {
     fprintf(fp, "VNCFlinger 1.0");
@@ -58,7 +106,520 @@ static void usage() {
     exit(1);
 }
 
+// what the server loop knows about an RFB client without asking
+// libtigervnc, which does not expose outstanding update requests
+struct ClientActivity {
+    // the client was written all of an update since the last frame was
+    // added. RFB clients ask for the next one as soon as they have it.
+    bool waiting;
+    // bytes written to the client before the last frame was added
+    size_t sentAtFrame;
+};
+
+// one capture pipeline and server per display
+struct Display {
+    int32_t id;
+    uint32_t layerStack;
+    sp<AndroidDesktop> desktop;
+    rfb::VNCServerST* server;
+    std::list<network::SocketListener*> listeners;
+    // every socket handed to the server, kept here rather than asking
+    // the server for a new list on every iteration
+    std::list<network::Socket*> sockets;
+    std::map<network::Socket*, ClientActivity> activity;
+};
+
+// a TCP listener which shares its port with the worker processes, the
+// kernel spreads new connections across all of them
+static int bindSharedTcpListener(const struct sockaddr* addr, socklen_t len) {
+    int fd = socket(addr->sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (addr->sa_family == AF_INET6) {
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &one, sizeof(one));
+    }
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0 ||
+        bind(fd, addr, len) < 0 || listen(fd, 5) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+// like createTcpListeners() and createLocalTcpListeners(), IPv4 and IPv6,
+// with SO_REUSEPORT so the workers can bind the same port
+static void createSharedTcpListener(std::list<network::SocketListener*>* listeners, int port) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(localhostOnly ? INADDR_LOOPBACK : INADDR_ANY);
+
+    struct sockaddr_in6 addr6;
+    memset(&addr6, 0, sizeof(addr6));
+    addr6.sin6_family = AF_INET6;
+    addr6.sin6_port = htons(port);
+    addr6.sin6_addr = localhostOnly ? in6addr_loopback : in6addr_any;
+
+    int fd = bindSharedTcpListener((struct sockaddr*)&addr, sizeof(addr));
+    if (fd < 0) {
+        throw rdr::SystemException("bind", errno);
+    }
+    listeners->push_back(new network::TcpListener(fd));
+
+    // a kernel without IPv6 only gets the IPv4 listener
+    fd = bindSharedTcpListener((struct sockaddr*)&addr6, sizeof(addr6));
+    if (fd >= 0) {
+        listeners->push_back(new network::TcpListener(fd));
+    } else if (errno != EAFNOSUPPORT && errno != EADDRNOTAVAIL) {
+        throw rdr::SystemException("bind", errno);
+    }
+}
+
+// the first display gets the configured sockets, others only listen
+// on consecutive TCP ports
+static void createListeners(Display* display, int index) {
+    std::list<network::SocketListener*>* listeners = &display->listeners;
+    int port = (int)rfbport + index;
+
+    if (index == 0 && rfbunixpath.getValueStr()[0] != '\0') {
+        listeners->push_back(new AndroidListener("vncflinger"));
+        ALOGI("Listening on %s (mode %04o)", (const char*)rfbunixpath, (int)rfbunixmode);
+    } else if (index == 0 && workers > 0) {
+        createSharedTcpListener(listeners, port);
+        ALOGI("Listening on port %d, shared with %d workers", port, (int)workers);
+    } else {
+        if (localhostOnly) {
+            network::createLocalTcpListeners(listeners, port);
+        } else {
+            network::createTcpListeners(listeners, 0, port);
+            ALOGI("Listening on port %d for display %d", port, display->id);
+        }
+    }
+    StartupTimer::mark("listeners");
+}
+
+// parse "id[:layerstack],..." from the Displays parameter
+static bool parseDisplays(std::vector<Display>* out) {
+    rfb::CharArray value(displays.getData());
+    char* save = NULL;
+    for (char* tok = strtok_r(value.buf, ",", &save); tok != NULL;
+         tok = strtok_r(NULL, ",", &save)) {
+        Display display;
+        char* end = NULL;
+        display.id = strtol(tok, &end, 10);
+        display.layerStack = display.id;
+        if (end == tok) {
+            return false;
+        }
+        if (*end == ':') {
+            char* stack = end + 1;
+            display.layerStack = strtoul(stack, &end, 10);
+            if (end == stack) {
+                return false;
+            }
+        }
+        if (*end != '\0') {
+            return false;
+        }
+        display.server = NULL;
+        out->push_back(display);
+    }
+    return !out->empty();
+}
+
+// hand pending client messages to the servers, this is where input is
+// injected into the system
+static void processClientInput(std::vector<Display>& dpys, fd_set* rfds) {
+    for (size_t d = 0; d < dpys.size(); d++) {
+        Display& dpy = dpys[d];
+        for (std::list<network::Socket*>::iterator i = dpy.sockets.begin();
+             i != dpy.sockets.end(); i++) {
+            if (FD_ISSET((*i)->getFd(), rfds)) {
+                ATRACE_NAME("client read");
+                dpy.server->processSocketReadEvent(*i);
+            }
+        }
+    }
+}
+
+// a FramebufferUpdate header with one rectangle header, all that a
+// cursor position or any other message without pixels takes
+static const size_t kBareUpdateBytes = 16;
+
+// the part of a large update around the pointer was written to a client
+// and has left every client's buffer, so the rest can go out right
+// behind it. anything larger than a bare update written since the frame
+// carries those pixels.
+static void flushDeferredUpdates(std::vector<Display>& dpys) {
+    for (size_t d = 0; d < dpys.size(); d++) {
+        Display& dpy = dpys[d];
+        if (!dpy.desktop->hasDeferredDamage()) {
+            continue;
+        }
+
+        bool written = false;
+        bool pending = false;
+        for (std::list<network::Socket*>::iterator i = dpy.sockets.begin();
+             !pending && i != dpy.sockets.end(); i++) {
+            rdr::OutStream& os = (*i)->outStream();
+            pending = os.bufferUsage() > 0;
+            written |= (size_t)os.length() - dpy.activity[*i].sentAtFrame > kBareUpdateBytes;
+        }
+        if (written && !pending) {
+            dpy.desktop->flushDeferredDamage();
+        }
+    }
+}
+
+// cork the clients which this pass is likely to write to: those being
+// read from, those with output left and those waiting for an update
+static void corkBusyClients(std::vector<Display>& dpys, const fd_set* rfds,
+                            SendBatcher* batcher) {
+    for (size_t d = 0; d < dpys.size(); d++) {
+        Display& dpy = dpys[d];
+        for (std::list<network::Socket*>::iterator i = dpy.sockets.begin();
+             i != dpy.sockets.end(); i++) {
+            int fd = (*i)->getFd();
+            if ((rfds != NULL && FD_ISSET(fd, rfds)) || (*i)->outStream().bufferUsage() > 0 ||
+                dpy.activity[*i].waiting) {
+                batcher->cork(fd);
+            }
+        }
+    }
+}
+
+// during long stretches of frame and output work, check whether input
+// has arrived in the meantime and handle it before continuing
+static void pollClientInput(std::vector<Display>& dpys, nsecs_t* deadline) {
+    nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+    if (now < *deadline) {
+        return;
+    }
+    *deadline = now + ms2ns(inputPollInterval);
+
+    fd_set rfds;
+    FD_ZERO(&rfds);
+    int maxFd = -1;
+    for (size_t d = 0; d < dpys.size(); d++) {
+        for (std::list<network::Socket*>::iterator i = dpys[d].sockets.begin();
+             i != dpys[d].sockets.end(); i++) {
+            if (!(*i)->isShutdown()) {
+                FD_SET((*i)->getFd(), &rfds);
+                maxFd = std::max(maxFd, (*i)->getFd());
+            }
+        }
+    }
+    if (maxFd < 0) {
+        return;
+    }
+
+    struct timeval tv = {0, 0};
+    if (select(maxFd + 1, &rfds, NULL, NULL, &tv) > 0) {
+        ATRACE_NAME("early input");
+        processClientInput(dpys, &rfds);
+    }
+}
+
+// the capture process starts capturing when a worker connects, so the
+// first frame can take a moment. accepted clients wait for it outside the
+// server, which needs a pixel buffer as soon as one of them is let in.
+static const int kConnectRetryMs = 100;
+static const int kFirstFrameTimeoutMs = 5000;
+
+// serves TCP clients from the local framebuffer of the capture process,
+// with the same loop as the capture process minus the displays
+static int runWorker(int index, const std::string& desktopName) {
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+    char threadName[16];
+    snprintf(threadName, sizeof(threadName), "vnc-worker-%d", index);
+    prctl(PR_SET_NAME, threadName);
+
+    try {
+        WorkerDesktop desktop(ANDROID_SOCKET_DIR "/vncflinger_fb");
+        rfb::VNCServerST server(desktopName.c_str(), &desktop);
+
+        std::list<network::SocketListener*> listeners;
+        createSharedTcpListener(&listeners, rfbport);
+        ALOGI("Worker %d listening on port %d", index, (int)rfbport);
+
+        std::list<network::Socket*> sockets;
+        SendBatcher batcher;
+
+        // accepted, but not yet handed to the server
+        std::list<network::Socket*> pending;
+        nsecs_t pendingSince = 0;
+        nsecs_t connectTime = 0;
+
+        // bytes written to each client when the current update arrived
+        std::map<network::Socket*, size_t> sentAtUpdate;
+        bool haveUpdate = false;
+        nsecs_t updateTime = 0;
+
+        while (!gCaughtSignal) {
+            fd_set rfds, wfds;
+            FD_ZERO(&rfds);
+            FD_ZERO(&wfds);
+
+            std::list<network::SocketListener*>::iterator l;
+            for (l = listeners.begin(); l != listeners.end(); l++) {
+                FD_SET((*l)->getFd(), &rfds);
+            }
+
+            std::list<network::Socket*>::iterator i;
+            for (i = sockets.begin(); i != sockets.end();) {
+                if ((*i)->isShutdown()) {
+                    batcher.remove((*i)->getFd());
+                    sentAtUpdate.erase(*i);
+                    server.removeSocket(*i);
+                    delete (*i);
+                    i = sockets.erase(i);
+                    continue;
+                }
+                FD_SET((*i)->getFd(), &rfds);
+                if ((*i)->outStream().bufferUsage() > 0) {
+                    FD_SET((*i)->getFd(), &wfds);
+                }
+                i++;
+            }
+            desktop.addFds(&rfds);
+
+            nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+            if (!pending.empty() && !desktop.isConnected() &&
+                now - connectTime >= ms2ns(kConnectRetryMs)) {
+                connectTime = now;
+                if (desktop.connectToCapture()) {
+                    desktop.addFds(&rfds);
+                }
+            }
+
+            // nothing to wait for once the capture or the clients are gone
+            haveUpdate = haveUpdate && desktop.hasUpdate() && !sockets.empty();
+
+            int wait_ms = 0;
+            rfb::soonestTimeout(&wait_ms, rfb::Timer::checkTimeouts());
+            if (haveUpdate) {
+                // wake up to stop waiting for a client which is not reading
+                nsecs_t left = updateTime + ms2ns(demandTimeout) -
+                               systemTime(SYSTEM_TIME_MONOTONIC);
+                rfb::soonestTimeout(&wait_ms, std::max(1, (int)ns2ms(left)));
+            }
+            if (!pending.empty()) {
+                // wake up to retry the connection or give up on the clients
+                nsecs_t left = pendingSince + ms2ns(kFirstFrameTimeoutMs) - now;
+                rfb::soonestTimeout(&wait_ms, std::max(1, (int)ns2ms(left)));
+                if (!desktop.isConnected()) {
+                    rfb::soonestTimeout(&wait_ms, kConnectRetryMs);
+                }
+            }
+
+            struct timeval tv;
+            tv.tv_sec = wait_ms / 1000;
+            tv.tv_usec = (wait_ms % 1000) * 1000;
+
+            int n = select(FD_SETSIZE, &rfds, &wfds, 0, wait_ms ? &tv : NULL);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw rdr::SystemException("select", errno);
+            }
+
+            // only clients which are read from or written to this pass
+            for (i = sockets.begin(); i != sockets.end(); i++) {
+                if (FD_ISSET((*i)->getFd(), &rfds) || FD_ISSET((*i)->getFd(), &wfds)) {
+                    batcher.cork((*i)->getFd());
+                }
+            }
+
+            // input goes to the capture process first
+            for (i = sockets.begin(); i != sockets.end(); i++) {
+                if (FD_ISSET((*i)->getFd(), &rfds)) {
+                    server.processSocketReadEvent(*i);
+                }
+            }
+
+            for (l = listeners.begin(); l != listeners.end(); l++) {
+                if (FD_ISSET((*l)->getFd(), &rfds)) {
+                    network::Socket* sock = (*l)->accept();
+                    if (sock) {
+                        sock->outStream().setBlocking(false);
+                        if (pending.empty()) {
+                            pendingSince = systemTime(SYSTEM_TIME_MONOTONIC);
+                        }
+                        pending.push_back(sock);
+                    }
+                }
+            }
+
+            desktop.processEvents(&rfds);
+
+            // a connection which was lost keeps its buffer until the server
+            // has let go of it, new clients wait for the next one
+            if (!pending.empty() && desktop.isConnected() && desktop.isReady()) {
+                for (i = pending.begin(); i != pending.end(); i++) {
+                    batcher.add((*i)->getFd());
+                    sockets.push_back(*i);
+                    server.addSocket(*i);
+                }
+                pending.clear();
+            } else if (!pending.empty() && systemTime(SYSTEM_TIME_MONOTONIC) - pendingSince >
+                                               ms2ns(kFirstFrameTimeoutMs)) {
+                ALOGW("Worker %d: no framebuffer from the capture process", index);
+                for (i = pending.begin(); i != pending.end(); i++) {
+                    delete (*i);
+                }
+                pending.clear();
+                if (sockets.empty()) {
+                    desktop.disconnect();
+                }
+            }
+
+            // anything written from here on can carry the new update, which
+            // goes to every client
+            if (desktop.hasUpdate() && !haveUpdate) {
+                haveUpdate = true;
+                updateTime = systemTime(SYSTEM_TIME_MONOTONIC);
+                for (i = sockets.begin(); i != sockets.end(); i++) {
+                    sentAtUpdate[*i] = (*i)->outStream().length();
+                    batcher.cork((*i)->getFd());
+                }
+            }
+
+            rfb::Timer::checkTimeouts();
+
+            for (i = sockets.begin(); i != sockets.end(); i++) {
+                if (FD_ISSET((*i)->getFd(), &wfds)) {
+                    server.processSocketWriteEvent(*i);
+                }
+            }
+
+            batcher.uncork();
+
+            // the pixels of an update may only change once every client has
+            // been sent it. one which did not ask for it within DemandTimeout
+            // no longer holds back the others.
+            if (haveUpdate && !sockets.empty()) {
+                bool timedOut =
+                    systemTime(SYSTEM_TIME_MONOTONIC) - updateTime > ms2ns(demandTimeout);
+                bool written = true;
+                for (i = sockets.begin(); written && i != sockets.end(); i++) {
+                    std::map<network::Socket*, size_t>::iterator s = sentAtUpdate.find(*i);
+                    if ((*i)->outStream().bufferUsage() > 0) {
+                        written = false;
+                    } else if (s != sentAtUpdate.end() &&
+                               s->second == (size_t)(*i)->outStream().length()) {
+                        written = timedOut;
+                    }
+                }
+                if (written) {
+                    haveUpdate = false;
+                    desktop.requestUpdate();
+                }
+            }
+        }
+    } catch (rdr::Exception& e) {
+        ALOGE("Worker %d: %s", index, e.str());
+        return 1;
+    }
+    return 0;
+}
+
+// a worker which exits sooner than this after starting is not restarted
+static const int kWorkerRestartMs = 1000;
+
+struct Worker {
+    int index;
+    pid_t pid;
+    nsecs_t started;
+};
+
+// wakes up the server loop, which reaps the worker
+static void onChildExited(__unused_attr int sig) {
+    int err = errno;
+    char c = 0;
+    write(gChildPipe[1], &c, 1);
+    errno = err;
+}
+
+// workers run this binary again, so they never inherit the threads or
+// the binder state of the capture process
+static void startWorker(Worker* worker, int argc, char** argv) {
+    char arg[32];
+    snprintf(arg, sizeof(arg), "--worker=%d", worker->index);
+    std::vector<char*> args;
+    args.push_back(argv[0]);
+    args.push_back(arg);
+    args.insert(args.end(), argv + 1, argv + argc);
+    args.push_back(NULL);
+
+    worker->started = systemTime(SYSTEM_TIME_MONOTONIC);
+    worker->pid = fork();
+    if (worker->pid == 0) {
+        execv("/proc/self/exe", args.data());
+        _exit(127);
+    } else if (worker->pid < 0) {
+        ALOGE("Failed to start worker %d: %s", worker->index, strerror(errno));
+    }
+}
+
+// only the pids of running workers may send input, so they are updated
+// right after a worker was reaped, before its pid can be reused
+static std::vector<pid_t> workerPids(const std::vector<Worker>& workers) {
+    std::vector<pid_t> pids;
+    for (size_t w = 0; w < workers.size(); w++) {
+        if (workers[w].pid > 0) {
+            pids.push_back(workers[w].pid);
+        }
+    }
+    return pids;
+}
+
+// true if any worker exited
+static bool reapWorkers(std::vector<Worker>* workers, int argc, char** argv) {
+    bool changed = false;
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (size_t w = 0; w < workers->size(); w++) {
+            Worker& worker = (*workers)[w];
+            if (worker.pid != pid) {
+                continue;
+            }
+            worker.pid = -1;
+            changed = true;
+            if (systemTime(SYSTEM_TIME_MONOTONIC) - worker.started < ms2ns(kWorkerRestartMs)) {
+                ALOGE("Worker %d exited right after starting (status %#x), not restarting it",
+                      worker.index, status);
+            } else {
+                ALOGW("Worker %d exited (status %#x), restarting it", worker.index, status);
+                startWorker(&worker, argc, argv);
+            }
+        }
+    }
+    return changed;
+}
+
+static void initCaptureThread() {
+    ThreadPolicy::apply(ThreadPolicy::ROLE_CAPTURE);
+    AllocCounter::track();
+}
+
+static void copyFrameTask(void* arg, size_t index) {
+    AndroidDesktop** ready = (AndroidDesktop**)arg;
+    ready[index]->copyFrame();
+}
+
 int main(int argc, char** argv) {
+    StartupTimer::mark("main");
+
     rfb::initAndroidLogger();
     rfb::LogWriter::setLogParams("*:android:30");
 
@@ -70,7 +631,15 @@ int main(int argc, char** argv) {
 
     rfb::Configuration::enableServerParams();
 
-    for (int i = 1; i < argc; i++) {
+    // workers get the same parameters, after their index
+    int workerIndex = 0;
+    int firstArg = 1;
+    if (argc > 1 && strncmp(argv[1], "--worker=", 9) == 0) {
+        workerIndex = atoi(argv[1] + 9);
+        firstArg = 2;
+    }
+
+    for (int i = firstArg; i < argc; i++) {
         if (rfb::Configuration::setParam(argv[i])) continue;
 
         if (argv[i][0] == '-') {
@@ -90,68 +659,196 @@ int main(int argc, char** argv) {
         usage();
     }
 
+    StartupTimer::mark("configuration");
+
+    if (workerIndex > 0) {
+        return runWorker(workerIndex, desktopName);
+    }
+
+    // workers share the capture through the local framebuffer. they are
+    // started before this process has any threads, and restarted when
+    // they exit.
+    std::vector<Worker> workerProcs;
+    if (workers > 0) {
+        localFramebuffer.setParam(true);
+
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = onChildExited;
+        sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+        if (pipe2(gChildPipe, O_CLOEXEC | O_NONBLOCK) < 0 || sigaction(SIGCHLD, &sa, NULL) < 0) {
+            ALOGE("Failed to watch workers: %s", strerror(errno));
+        }
+
+        for (int w = 1; w <= workers; w++) {
+            Worker worker = {w, -1, 0};
+            startWorker(&worker, argc, argv);
+            workerProcs.push_back(worker);
+        }
+    }
+
     sp<ProcessState> self = ProcessState::self();
     self->startThreadPool();
+    StartupTimer::mark("binder thread pool");
 
-    std::list<network::SocketListener*> listeners;
+    // this thread injects input and encodes. binder threads are started
+    // first so they do not inherit its placement.
+    ThreadPolicy::apply(ThreadPolicy::ROLE_SERVER);
+    AllocCounter::track();
+
+    std::vector<Display> dpys;
+    if (!parseDisplays(&dpys)) {
+        fprintf(stderr, "Invalid display list: %s\n", (const char*)displays);
+        usage();
+    }
 
     try {
-        sp<AndroidDesktop> desktop = new AndroidDesktop();
-        rfb::VNCServerST server(desktopName.c_str(), desktop.get());
+        // sockets are set up while the displays are queried and the
+        // input device is created, none of these depend on each other
+        std::vector<std::future<void> > listenersReady;
+        for (size_t d = 0; d < dpys.size(); d++) {
+            listenersReady.push_back(
+                std::async(std::launch::async, createListeners, &dpys[d], (int)d));
+        }
+
+        for (size_t d = 0; d < dpys.size(); d++) {
+            std::string name = desktopName;
+            if (d > 0) {
+                char suffix[32];
+                snprintf(suffix, sizeof(suffix), " (display %d)", dpys[d].id);
+                name += suffix;
+            }
 
-        if (rfbunixpath.getValueStr()[0] != '\0') {
-            listeners.push_back(new AndroidListener("vncflinger"));
-            ALOGI("Listening on %s (mode %04o)", (const char*)rfbunixpath, (int)rfbunixmode);
+            dpys[d].desktop = new AndroidDesktop(dpys[d].id, dpys[d].layerStack);
+            if (dpys[d].desktop->prepare() != NO_ERROR) {
+                ALOGW("Display %d not ready, deferring setup until first connection", dpys[d].id);
+            }
+            dpys[d].server = new rfb::VNCServerST(name.c_str(), dpys[d].desktop.get());
+
+            int eventFd = dpys[d].desktop->getEventFd();
+            fcntl(eventFd, F_SETFL, O_NONBLOCK);
+        }
+
+        sp<AndroidDesktop> desktop = dpys[0].desktop;
+
+        sp<SharedFramebuffer> sharedFb;
+        if (localFramebuffer) {
+            sharedFb = new SharedFramebuffer("vncflinger_fb");
+            sharedFb->setInputPids(workerPids(workerProcs));
+            desktop->setSharedFramebuffer(dpys[0].server, sharedFb);
+            ALOGI("Serving local framebuffer on vncflinger_fb");
         } else {
-            if (localhostOnly) {
-                network::createLocalTcpListeners(&listeners, (int)rfbport);
-            } else {
-                network::createTcpListeners(&listeners, 0, (int)rfbport);
-                ALOGI("Listening on port %d", (int)rfbport);
+            // init creates the socket without knowing the parameters,
+            // unused it refuses connections rather than queueing them
+            int fd = android_get_control_socket("vncflinger_fb");
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+
+        for (size_t d = 0; d < dpys.size(); d++) {
+            sp<VNCService> service = new VNCService(dpys[d].desktop);
+            if (defaultServiceManager()->addService(VNCService::getServiceName(d), service) !=
+                NO_ERROR) {
+                ALOGW("Failed to register control service for display %d", dpys[d].id);
             }
         }
 
-        int eventFd = desktop->getEventFd();
-        fcntl(eventFd, F_SETFL, O_NONBLOCK);
+        for (size_t d = 0; d < dpys.size(); d++) {
+            listenersReady[d].get();
+        }
+
+        // every display beyond the first gets its own copy thread
+        WorkerPool capturePool(dpys.size() - 1, "capture", initCaptureThread);
+        std::vector<AndroidDesktop*> ready;
+        ready.reserve(dpys.size());
+
+        StartupTimer::mark("ready");
+        StartupTimer::dump();
+
+        bool firstClient = true;
+        SendBatcher batcher;
+
+        MemoryPressure pressure;
+        if (memoryPressure) {
+            pressure.open();
+        }
 
         while (!gCaughtSignal) {
             int wait_ms;
             struct timeval tv;
-            fd_set rfds, wfds;
-            std::list<network::Socket*> sockets;
+            fd_set rfds, wfds, efds;
             std::list<network::Socket*>::iterator i;
 
             FD_ZERO(&rfds);
             FD_ZERO(&wfds);
+            FD_ZERO(&efds);
 
-            FD_SET(eventFd, &rfds);
-            for (std::list<network::SocketListener*>::iterator i = listeners.begin();
-                 i != listeners.end(); i++)
-                FD_SET((*i)->getFd(), &rfds);
+            for (size_t d = 0; d < dpys.size(); d++) {
+                Display& dpy = dpys[d];
 
-            server.getSockets(&sockets);
-            int clients_connected = 0;
-            for (i = sockets.begin(); i != sockets.end(); i++) {
-                if ((*i)->isShutdown()) {
-                    server.removeSocket(*i);
-                    delete (*i);
-                } else {
+                FD_SET(dpy.desktop->getEventFd(), &rfds);
+                for (std::list<network::SocketListener*>::iterator i = dpy.listeners.begin();
+                     i != dpy.listeners.end(); i++)
                     FD_SET((*i)->getFd(), &rfds);
-                    if ((*i)->outStream().bufferUsage() > 0) {
-                        FD_SET((*i)->getFd(), &wfds);
+
+                int clients_connected = 0;
+                bool demand = d == 0 && sharedFb != NULL && sharedFb->hasRequests();
+                for (i = dpy.sockets.begin(); i != dpy.sockets.end();) {
+                    // input is read from this list right after select(),
+                    // so closed sockets must not stay in it
+                    if ((*i)->isShutdown()) {
+                        batcher.remove((*i)->getFd());
+                        dpy.activity.erase(*i);
+                        dpy.server->removeSocket(*i);
+                        delete (*i);
+                        i = dpy.sockets.erase(i);
+                    } else {
+                        FD_SET((*i)->getFd(), &rfds);
+
+                        // a client still sending the last update can't take
+                        // another one yet. one which was written more than a
+                        // bare update since the last frame has that frame and
+                        // asked for the next. input and other small messages
+                        // are no demand.
+                        ClientActivity& activity = dpy.activity[*i];
+                        rdr::OutStream& os = (*i)->outStream();
+                        if (os.bufferUsage() > 0) {
+                            FD_SET((*i)->getFd(), &wfds);
+                        } else if ((size_t)os.length() - activity.sentAtFrame >
+                                   kBareUpdateBytes) {
+                            activity.waiting = true;
+                        }
+                        demand |= activity.waiting;
+                        clients_connected++;
+                        i++;
                     }
-                    clients_connected++;
                 }
+                dpy.desktop->setClientCount(clients_connected);
+                dpy.desktop->setClientDemand(demand);
+                dpy.desktop->setMemoryPressure(pressure.level());
+            }
+
+            if (sharedFb != NULL) {
+                sharedFb->addFds(&rfds, &wfds);
+            }
+            pressure.addFds(&efds);
+            if (gChildPipe[0] >= 0) {
+                FD_SET(gChildPipe[0], &rfds);
             }
 
             wait_ms = 0;
 
+            // deferred updates are written from the timers, they go out
+            // in full segments like the rest
+            corkBusyClients(dpys, NULL, &batcher);
             rfb::soonestTimeout(&wait_ms, rfb::Timer::checkTimeouts());
+            batcher.uncork();
 
             tv.tv_sec = wait_ms / 1000;
             tv.tv_usec = (wait_ms % 1000) * 1000;
 
-            int n = select(FD_SETSIZE, &rfds, &wfds, 0, wait_ms ? &tv : NULL);
+            int n = select(FD_SETSIZE, &rfds, &wfds, &efds, wait_ms ? &tv : NULL);
 
             if (n < 0) {
                 if (errno == EINTR) {
@@ -162,42 +859,139 @@ int main(int argc, char** argv) {
                 }
             }
 
+            pressure.processEvents(&efds);
+
+            if (gChildPipe[0] >= 0 && FD_ISSET(gChildPipe[0], &rfds)) {
+                char buf[16];
+                while (read(gChildPipe[0], buf, sizeof(buf)) > 0) {
+                }
+                if (reapWorkers(&workerProcs, argc, argv) && sharedFb != NULL) {
+                    sharedFb->setInputPids(workerPids(workerProcs));
+                }
+            }
+
+            // Input goes first, before anything that could delay it
+            corkBusyClients(dpys, &rfds, &batcher);
+            processClientInput(dpys, &rfds);
+
             // Accept new VNC connections
-            for (std::list<network::SocketListener*>::iterator i = listeners.begin();
-                 i != listeners.end(); i++) {
-                if (FD_ISSET((*i)->getFd(), &rfds)) {
-                    network::Socket* sock = (*i)->accept();
-                    if (sock) {
-                        sock->outStream().setBlocking(false);
-                        server.addSocket(sock);
-                    } else {
-                        ALOGW("Client connection rejected");
+            for (size_t d = 0; d < dpys.size(); d++) {
+                Display& dpy = dpys[d];
+                for (std::list<network::SocketListener*>::iterator i = dpy.listeners.begin();
+                     i != dpy.listeners.end(); i++) {
+                    if (FD_ISSET((*i)->getFd(), &rfds)) {
+                        network::Socket* sock = (*i)->accept();
+                        if (sock) {
+                            if (firstClient) {
+                                firstClient = false;
+                                StartupTimer::mark("first client");
+                            }
+                            sock->outStream().setBlocking(false);
+                            batcher.add(sock->getFd());
+                            ClientActivity activity = {true, 0};
+                            dpy.activity[sock] = activity;
+                            dpy.sockets.push_back(sock);
+                            dpy.server->addSocket(sock);
+                        } else {
+                            ALOGW("Client connection rejected");
+                        }
                     }
                 }
             }
 
+            if (sharedFb != NULL) {
+                sharedFb->processEvents(&rfds, &wfds);
+            }
+
             rfb::Timer::checkTimeouts();
 
             // Client list could have been changed.
-            server.getSockets(&sockets);
+            bool haveClients = sharedFb != NULL && sharedFb->hasClients();
+            for (size_t d = 0; d < dpys.size(); d++) {
+                haveClients |= !dpys[d].sockets.empty();
+            }
 
             // Nothing more to do if there are no client connections.
-            if (sockets.empty()) continue;
+            if (!haveClients) {
+                // settings changed meanwhile are picked up, and the event
+                // cleared so that select() does not return right away
+                for (size_t d = 0; d < dpys.size(); d++) {
+                    uint64_t eventVal;
+                    if (read(dpys[d].desktop->getEventFd(), &eventVal, sizeof(eventVal)) > 0) {
+                        dpys[d].desktop->beginFrame();
+                    }
+                }
+                batcher.uncork();
+                continue;
+            }
 
-            // Process events on existing VNC connections
-            for (i = sockets.begin(); i != sockets.end(); i++) {
-                if (FD_ISSET((*i)->getFd(), &rfds)) server.processSocketReadEvent(*i);
-                if (FD_ISSET((*i)->getFd(), &wfds)) server.processSocketWriteEvent(*i);
+            // Frame and output work is sliced so that input which arrives
+            // meanwhile does not wait for all of it
+            nsecs_t inputDeadline = systemTime(SYSTEM_TIME_MONOTONIC) + ms2ns(inputPollInterval);
+
+            // Process events from the displays, copying all of them at once
+            ready.clear();
+            for (size_t d = 0; d < dpys.size(); d++) {
+                pollClientInput(dpys, &inputDeadline);
+
+                uint64_t eventVal;
+                int status = read(dpys[d].desktop->getEventFd(), &eventVal, sizeof(eventVal));
+                if (status > 0 && eventVal > 0) {
+                    ATRACE_INT64("VNC pending frames", eventVal);
+                    ALOGV("display=%d status=%d eventval=%" PRIu64, dpys[d].id, status, eventVal);
+                    if (dpys[d].desktop->beginFrame()) {
+                        ready.push_back(dpys[d].desktop.get());
+                    }
+                }
+            }
+            {
+                ATRACE_NAME("copy frames");
+                capturePool.run(copyFrameTask, ready.data(), ready.size());
+            }
+            // the server may write the frame as soon as it is added
+            for (size_t d = 0; d < dpys.size(); d++) {
+                Display& dpy = dpys[d];
+                if (std::find(ready.begin(), ready.end(), dpy.desktop.get()) == ready.end()) {
+                    continue;
+                }
+                for (i = dpy.sockets.begin(); i != dpy.sockets.end(); i++) {
+                    dpy.activity[*i].sentAtFrame = (*i)->outStream().length();
+                }
+                if (dpy.desktop->endFrame()) {
+                    for (i = dpy.sockets.begin(); i != dpy.sockets.end(); i++) {
+                        dpy.activity[*i].waiting = false;
+                    }
+                }
             }
 
-            // Process events from the display
-            uint64_t eventVal;
-            int status = read(eventFd, &eventVal, sizeof(eventVal));
-            if (status > 0 && eventVal > 0) {
-                ALOGV("status=%d eventval=%" PRIu64, status, eventVal);
-                desktop->processFrames();
+            // Flush pending output, updates are encoded from within these
+            for (size_t d = 0; d < dpys.size(); d++) {
+                Display& dpy = dpys[d];
+                for (i = dpy.sockets.begin(); i != dpy.sockets.end(); i++) {
+                    pollClientInput(dpys, &inputDeadline);
+                    if (FD_ISSET((*i)->getFd(), &wfds)) {
+                        ATRACE_NAME("client write");
+                        dpy.server->processSocketWriteEvent(*i);
+                    }
+                    if (ATRACE_ENABLED()) {
+                        char counter[48];
+                        snprintf(counter, sizeof(counter), "VNC client output %d:%d", dpy.id,
+                                 (*i)->getFd());
+                        ATRACE_INT(counter, (*i)->outStream().bufferUsage());
+                    }
+                }
             }
 
+            {
+                ATRACE_NAME("flush");
+                batcher.uncork();
+            }
+
+            flushDeferredUpdates(dpys);
+        }
+
+        for (size_t d = 0; d < dpys.size(); d++) {
+            delete dpys[d].server;
         }
 
     } catch (rdr::Exception& e) {
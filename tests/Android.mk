@@ -0,0 +1,33 @@
+LOCAL_PATH := $(call my-dir)
+
+# device only, libtigervnc and libui are not built for the host
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+    FrameCopier_test.cpp \
+    SharedFramebuffer_test.cpp \
+    ../src/AllocCounter.cpp \
+    ../src/AndroidPixelBuffer.cpp \
+    ../src/FrameCopier.cpp \
+    ../src/SharedFramebuffer.cpp \
+    ../src/WorkerPool.cpp
+
+LOCAL_C_INCLUDES += \
+    $(LOCAL_PATH)/../src \
+    external/tigervnc/common \
+
+LOCAL_SHARED_LIBRARIES := \
+    libcutils \
+    liblog \
+    libui \
+    libutils
+
+LOCAL_STATIC_LIBRARIES += \
+    libtigervnc
+
+LOCAL_CFLAGS := -Werror -std=c++11 -fexceptions
+LOCAL_CFLAGS += -DVNCFLINGER_COUNT_ALLOCATIONS
+
+LOCAL_MODULE := vncflinger_tests
+
+include $(BUILD_NATIVE_TEST)
@@ -0,0 +1,116 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <string.h>
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <rfb/Rect.h>
+#include <rfb/Region.h>
+
+#include "AllocCounter.h"
+#include "FrameCopier.h"
+
+using namespace vncflinger;
+
+namespace {
+
+void initCopyThread() {
+    AllocCounter::track();
+}
+
+const int kWidth = 300;
+const int kHeight = 200;
+const int kBytesPerPixel = 4;
+const int kStride = kWidth * kBytesPerPixel;
+
+class FrameCopierTest : public ::testing::Test {
+  protected:
+    FrameCopierTest()
+        : mSrc(kStride * kHeight, 0), mDst(kStride * kHeight, 0), mCopier(2, initCopyThread) {
+    }
+
+    virtual void SetUp() {
+        AllocCounter::track();
+    }
+
+    size_t copy(bool force) {
+        return mCopier.copy(mSrc.data(), kStride, mDst.data(), kStride, kWidth, kHeight,
+                            kBytesPerPixel, force, &mChanged);
+    }
+
+    void touch(int x, int y) {
+        mSrc[y * kStride + x * kBytesPerPixel]++;
+    }
+
+    std::vector<uint8_t> mSrc;
+    std::vector<uint8_t> mDst;
+    FrameCopier mCopier;
+    rfb::Region mChanged;
+};
+
+TEST_F(FrameCopierTest, ForcedCopyMarksEverything) {
+    touch(10, 10);
+    EXPECT_EQ((size_t)(kWidth * kHeight), copy(true));
+    EXPECT_TRUE(mChanged.equals(rfb::Region(rfb::Rect(0, 0, kWidth, kHeight))));
+    EXPECT_EQ(0, memcmp(mSrc.data(), mDst.data(), mSrc.size()));
+}
+
+TEST_F(FrameCopierTest, UnchangedFrameHasNoDamage) {
+    copy(true);
+    EXPECT_EQ(0u, copy(false));
+    EXPECT_TRUE(mChanged.is_empty());
+}
+
+TEST_F(FrameCopierTest, DamageCoversChangedTiles) {
+    ASSERT_EQ(64, FrameCopier::kTileSize);
+    copy(true);
+
+    // a single tile, a run of two tiles and the clipped bottom right one
+    touch(70, 5);
+    touch(1, 130);
+    touch(65, 130);
+    touch(299, 199);
+    size_t area = copy(false);
+
+    rfb::Region expected(rfb::Rect(64, 0, 128, 64));
+    expected.assign_union(rfb::Region(rfb::Rect(0, 128, 128, 192)));
+    expected.assign_union(rfb::Region(rfb::Rect(256, 192, 300, 200)));
+
+    EXPECT_TRUE(mChanged.equals(expected));
+    EXPECT_EQ((size_t)(64 * 64 + 128 * 64 + 44 * 8), area);
+    EXPECT_EQ(0, memcmp(mSrc.data(), mDst.data(), mSrc.size()));
+}
+
+// only operator new is counted, the damage region mallocs on its own
+TEST_F(FrameCopierTest, SteadyStateDoesNotCallNew) {
+    // the first frames size the scratch memory
+    copy(true);
+    touch(5, 5);
+    copy(false);
+
+    uint64_t before = AllocCounter::count();
+    for (int i = 0; i < 16; i++) {
+        touch((i * 37) % kWidth, (i * 53) % kHeight);
+        copy(false);
+    }
+    EXPECT_EQ(before, AllocCounter::count());
+}
+
+}  // namespace
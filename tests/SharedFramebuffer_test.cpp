@@ -0,0 +1,240 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+
+#include <ui/DisplayInfo.h>
+
+#include <rfb/Rect.h>
+#include <rfb/Region.h>
+
+#include "AllocCounter.h"
+#include "AndroidPixelBuffer.h"
+#include "SharedFramebuffer.h"
+
+using namespace vncflinger;
+
+namespace {
+
+const int kWidth = 128;
+const int kHeight = 64;
+
+class SharedFramebufferTest : public ::testing::Test {
+  protected:
+    SharedFramebufferTest() : mClientFd(-1), mBufferFd(-1), mMap(NULL), mMapSize(0) {
+    }
+
+    virtual void SetUp() {
+        // abstract address, nothing to clean up in the filesystem
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1, "vncflinger_test_%d", getpid());
+        socklen_t len = offsetof(struct sockaddr_un, sun_path) + 1 + strlen(addr.sun_path + 1);
+
+        int listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        ASSERT_LE(0, listenFd);
+        ASSERT_EQ(0, bind(listenFd, (struct sockaddr*)&addr, len));
+        mFb = new SharedFramebuffer(listenFd);
+
+        mClientFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        ASSERT_LE(0, mClientFd);
+        ASSERT_EQ(0, connect(mClientFd, (struct sockaddr*)&addr, len));
+        pump();
+        ASSERT_TRUE(mFb->hasClients());
+
+        DisplayInfo info;
+        info.w = kWidth;
+        info.h = kHeight;
+        info.orientation = DISPLAY_ORIENTATION_0;
+        mPb = new AndroidPixelBuffer();
+        mPb->setDisplayInfo(&info);
+        ASSERT_EQ(kWidth, mPb->width());
+        ASSERT_EQ(kHeight, mPb->height());
+        fill(rfb::Rect(0, 0, kWidth, kHeight), 0);
+
+        AllocCounter::track();
+    }
+
+    virtual void TearDown() {
+        if (mMap != NULL) {
+            munmap(mMap, mMapSize);
+        }
+        if (mClientFd >= 0) {
+            close(mClientFd);
+        }
+        mFb.clear();
+    }
+
+    // one pass of the server loop
+    void pump() {
+        fd_set rfds, wfds;
+        FD_ZERO(&rfds);
+        FD_ZERO(&wfds);
+        mFb->addFds(&rfds, &wfds);
+        struct timeval tv = {0, 100000};
+        select(FD_SETSIZE, &rfds, &wfds, NULL, &tv);
+        mFb->processEvents(&rfds, &wfds);
+    }
+
+    void fill(const rfb::Rect& r, uint32_t pixel) {
+        mPb->fillRect(r, &pixel);
+    }
+
+    void request() {
+        ASSERT_EQ(1, write(mClientFd, "r", 1));
+        pump();
+    }
+
+    // reads an UPDATE, mapping the buffer first if one was sent
+    void receive(LocalFbRect* rects, size_t maxRects, size_t* count) {
+        LocalFbMessage msg;
+        ASSERT_EQ((ssize_t)sizeof(msg), recvFd(&msg, sizeof(msg)));
+        ASSERT_EQ((uint32_t)LocalFbMessage::MAGIC, msg.magic);
+
+        if (msg.type == LocalFbMessage::TYPE_BUFFER) {
+            LocalFbBuffer buffer;
+            ASSERT_EQ((ssize_t)sizeof(buffer), read(mClientFd, &buffer, sizeof(buffer)));
+            EXPECT_EQ((uint32_t)kWidth, buffer.width);
+            EXPECT_EQ((uint32_t)kHeight, buffer.height);
+            ASSERT_EQ((uint32_t)kWidth * 4, buffer.stride);
+            ASSERT_LE(0, mBufferFd);
+            mMapSize = buffer.size;
+            mMap = (uint8_t*)mmap(NULL, mMapSize, PROT_READ, MAP_SHARED, mBufferFd, 0);
+            close(mBufferFd);
+            ASSERT_NE(MAP_FAILED, (void*)mMap);
+
+            ASSERT_EQ((ssize_t)sizeof(msg), read(mClientFd, &msg, sizeof(msg)));
+        }
+
+        ASSERT_EQ((uint32_t)LocalFbMessage::TYPE_UPDATE, msg.type);
+        ASSERT_GE(maxRects, msg.count);
+        ssize_t len = msg.count * sizeof(LocalFbRect);
+        ASSERT_EQ(len, read(mClientFd, rects, len));
+        *count = msg.count;
+    }
+
+    ssize_t recvFd(void* data, size_t len) {
+        struct iovec iov;
+        iov.iov_base = data;
+        iov.iov_len = len;
+
+        char control[CMSG_SPACE(sizeof(int))];
+        struct msghdr hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_iov = &iov;
+        hdr.msg_iovlen = 1;
+        hdr.msg_control = control;
+        hdr.msg_controllen = sizeof(control);
+
+        mBufferFd = -1;
+        ssize_t n = recvmsg(mClientFd, &hdr, 0);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+        if (cmsg != NULL && cmsg->cmsg_type == SCM_RIGHTS) {
+            memcpy(&mBufferFd, CMSG_DATA(cmsg), sizeof(int));
+        }
+        return n;
+    }
+
+    uint32_t pixelAt(int x, int y) {
+        uint32_t pixel;
+        memcpy(&pixel, mMap + y * kWidth * 4 + x * 4, sizeof(pixel));
+        return pixel;
+    }
+
+    sp<SharedFramebuffer> mFb;
+    sp<AndroidPixelBuffer> mPb;
+    int mClientFd;
+    int mBufferFd;
+    uint8_t* mMap;
+    size_t mMapSize;
+};
+
+TEST_F(SharedFramebufferTest, FirstUpdateCarriesBuffer) {
+    fill(rfb::Rect(0, 0, kWidth, kHeight), 0x11223344);
+    request();
+    mFb->publish(mPb, rfb::Region(rfb::Rect(0, 0, kWidth, kHeight)));
+
+    LocalFbRect rects[64];
+    size_t count = 0;
+    receive(rects, 64, &count);
+    ASSERT_EQ(1u, count);
+    EXPECT_EQ(0, rects[0].x);
+    EXPECT_EQ(0, rects[0].y);
+    EXPECT_EQ(kWidth, rects[0].w);
+    EXPECT_EQ(kHeight, rects[0].h);
+    ASSERT_TRUE(mMap != NULL);
+    EXPECT_EQ(0x11223344u, pixelAt(kWidth - 1, kHeight - 1));
+}
+
+TEST_F(SharedFramebufferTest, UpdateWaitsForRequest) {
+    request();
+    mFb->publish(mPb, rfb::Region(rfb::Rect(0, 0, kWidth, kHeight)));
+    LocalFbRect rects[64];
+    size_t count = 0;
+    receive(rects, 64, &count);
+
+    // damage without a request is held back and not copied yet
+    fill(rfb::Rect(8, 8, 16, 16), 0x55);
+    mFb->publish(mPb, rfb::Region(rfb::Rect(8, 8, 16, 16)));
+    char c;
+    EXPECT_EQ(-1, recv(mClientFd, &c, 1, MSG_DONTWAIT));
+    EXPECT_EQ(0u, pixelAt(8, 8));
+
+    request();
+    receive(rects, 64, &count);
+    ASSERT_EQ(1u, count);
+    EXPECT_EQ(8, rects[0].x);
+    EXPECT_EQ(8, rects[0].w);
+    EXPECT_EQ(0x55u, pixelAt(8, 8));
+}
+
+// only operator new is counted, the regions malloc on their own
+TEST_F(SharedFramebufferTest, SteadyStateDoesNotCallNew) {
+    LocalFbRect rects[64];
+    size_t count = 0;
+
+    // the first updates allocate the shared memory and scratch vectors
+    for (int i = 0; i < 4; i++) {
+        request();
+        mFb->publish(mPb, rfb::Region(rfb::Rect(0, 0, kWidth, kHeight)));
+        receive(rects, 64, &count);
+    }
+
+    uint64_t before = AllocCounter::count();
+    for (int i = 0; i < 16; i++) {
+        rfb::Rect r(i * 4, i * 2, i * 4 + 16, i * 2 + 8);
+        fill(r, i);
+        request();
+        mFb->publish(mPb, rfb::Region(r));
+        receive(rects, 64, &count);
+        ASSERT_EQ(1u, count);
+        ASSERT_EQ((uint32_t)i, pixelAt(r.tl.x, r.tl.y));
+    }
+    EXPECT_EQ(before, AllocCounter::count());
+}
+
+}  // namespace